@@ -0,0 +1,116 @@
+#include "bufpool.hh"
+
+/** @brief Lease a buffer of at least @a size bytes.
+
+    The returned String is unshared and its length() is the buffer's full
+    capacity. Return it with release(). */
+String buffer_pool::lease(size_t size) {
+    size_t sz = size_class(size);
+    std::vector<String>& idle = idle_[class_index(sz)];
+    ++nleased_;
+    if (!idle.empty()) {
+        String buf = std::move(idle.back());
+        idle.pop_back();
+        idle_bytes_ -= buf.length();
+        ++nhits_;
+        return buf;
+    }
+    ++nmisses_;
+    StringAccum sa((int) sz);
+    sa.set_length(sa.capacity());
+    return sa.take_string();
+}
+
+/** @brief Lease a buffer of at least @a size bytes into @a sa.
+
+    @pre @a sa has no buffer. On return @a sa is empty, with capacity()
+    at least @a size. */
+void buffer_pool::lease(StringAccum& sa, size_t size) {
+    assert(!sa.capacity());
+    String buf = lease(size);
+    // a StringAccum may reallocate and free its buffer behind our back
+    forget(buf);
+    sa = StringAccum::make_transfer(buf);
+    sa.clear();
+}
+
+/** @brief Return @a buf to the pool, leaving it empty.
+
+    A buffer still shared with substrings is not reused; it is freed when
+    its last reference goes away. */
+void buffer_pool::release(String& buf) {
+    if (!buf)
+        return;
+    --nleased_;
+    size_t sz = buf.length();
+    if (buf.is_shared()) {
+        forget(buf);
+        ++nshared_;
+    } else if (sz < size_t(min_size) || sz > size_t(2 * max_size)
+               || idle_bytes_ + sz > limit_) {
+        forget(buf);
+        ++nfreed_;
+    } else {
+        idle_bytes_ += sz;
+        idle_[class_index(sz)].push_back(std::move(buf));
+    }
+    buf = String();
+}
+
+/** @brief Return @a sa's buffer to the pool, leaving @a sa with none. */
+void buffer_pool::release(StringAccum& sa) {
+    if (sa.capacity() <= 0)
+        return;
+    sa.set_length(sa.capacity());
+    String buf = sa.take_string();
+    release(buf);
+}
+
+/** @brief Set the number of idle bytes the pool may hold.
+
+    Idle buffers beyond the new limit are freed at once. */
+void buffer_pool::set_limit(size_t limit) {
+    limit_ = limit;
+    for (int i = nclasses - 1; i >= 0 && idle_bytes_ > limit_; --i)
+        while (!idle_[i].empty() && idle_bytes_ > limit_) {
+            forget(idle_[i].back());
+            idle_bytes_ -= idle_[i].back().length();
+            idle_[i].pop_back();
+            ++nfreed_;
+        }
+}
+
+/** @brief Record that leased buffer @a buf is registered in @a slot.
+
+    When the pool lets go of @a buf, it calls @a unregister(@a slot). */
+void buffer_pool::set_slot(const String& buf, int slot,
+                           void (*unregister)(int)) {
+    assert(slot >= 0 && (!unregister_ || unregister_ == unregister));
+    unregister_ = unregister;
+    slots_[buf.data()] = slot;
+}
+
+void buffer_pool::forget(const String& buf) {
+    if (!slots_.empty()) {
+        auto it = slots_.find(buf.data());
+        if (it != slots_.end()) {
+            unregister_(it->second);
+            slots_.erase(it);
+        }
+    }
+}
+
+Json buffer_pool::status() const {
+    Json classes = Json::make_array();
+    for (int i = 0; i != nclasses; ++i)
+        classes.push_back(Json::array(size_t(min_size) << i, idle_[i].size()));
+    return Json::object("leased", nleased_,
+                        "idle_bytes", idle_bytes_,
+                        "limit", limit_,
+                        "hits", nhits_,
+                        "misses", nmisses_,
+                        "freed", nfreed_,
+                        "shared", nshared_,
+                        "registered", slots_.size(),
+                        "idle", classes);
+}
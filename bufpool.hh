@@ -0,0 +1,111 @@
+// -*- mode: c++ -*-
+#ifndef MPRPC_BUFPOOL_HH
+#define MPRPC_BUFPOOL_HH
+#include "json.hh"
+#include <unordered_map>
+#include <vector>
+
+// buffer_pool: idle I/O buffers shared by every connection in the process.
+//
+// Buffers come in power-of-two size classes from min_size to max_size.
+// A connection leases a buffer only while it has data to read or write,
+// and releases it when it goes idle, so idle connections hold no buffer
+// memory. Released buffers are kept for reuse until the pool holds
+// limit() idle bytes; past that they are freed. A buffer is stored as an
+// unshared String and converted to and from StringAccum without copying.
+//
+// Only unshared buffers can be reused. A read buffer usually is still
+// shared when released, because decoded messages keep substrings of it,
+// so it is freed when the last of those goes away and most of the
+// pool's savings come from write buffers. status() reports lease "hits"
+// and "misses", and counts buffers released while "shared", so the
+// savings can be checked.
+//
+// A buffer may be registered with an I/O engine, such as io_uring's fixed
+// buffers, by recording its slot with set_slot(). The registration follows
+// the buffer through later leases and is dropped, through the unregister
+// function, when the pool lets go of the buffer, so each buffer is
+// registered at most once while the pool holds it.
+
+class buffer_pool {
+  public:
+    enum { min_size = 1 << 12, max_size = 1 << 17 };
+
+    inline buffer_pool();
+    static inline buffer_pool& global();
+
+    static inline size_t size_class(size_t size);
+
+    String lease(size_t size);
+    void lease(StringAccum& sa, size_t size);
+    void release(String& buf);
+    void release(StringAccum& sa);
+
+    inline size_t limit() const;
+    void set_limit(size_t limit);
+
+    inline int slot(const String& buf) const;
+    void set_slot(const String& buf, int slot, void (*unregister)(int));
+
+    Json status() const;
+
+  private:
+    enum { nclasses = 6 };
+    std::vector<String> idle_[nclasses];
+    size_t limit_;
+    size_t idle_bytes_;
+    size_t nleased_;
+    unsigned long nhits_;
+    unsigned long nmisses_;
+    unsigned long nfreed_;
+    unsigned long nshared_;
+    std::unordered_map<const char*, int> slots_;
+    void (*unregister_)(int);
+
+    static inline int class_index(size_t size);
+    void forget(const String& buf);
+};
+
+inline buffer_pool::buffer_pool()
+    : limit_(size_t(1) << 25), idle_bytes_(0), nleased_(0),
+      nhits_(0), nmisses_(0), nfreed_(0), nshared_(0),
+      unregister_(nullptr) {
+}
+
+/** @brief Return the process-wide buffer pool.
+
+    The pool is never destroyed, so buffers may be released to it from
+    static destructors. */
+inline buffer_pool& buffer_pool::global() {
+    static buffer_pool* pool = new buffer_pool;
+    return *pool;
+}
+
+/** @brief Return the buffer size leased for a request of @a size bytes. */
+inline size_t buffer_pool::size_class(size_t size) {
+    size_t sz = min_size;
+    while (sz < size && sz < max_size)
+        sz <<= 1;
+    return sz;
+}
+
+inline int buffer_pool::class_index(size_t size) {
+    int i = 0;
+    while (i + 1 < nclasses && (size_t(min_size) << (i + 1)) <= size)
+        ++i;
+    return i;
+}
+
+inline size_t buffer_pool::limit() const {
+    return limit_;
+}
+
+/** @brief Return the slot recorded for leased buffer @a buf, or -1. */
+inline int buffer_pool::slot(const String& buf) const {
+    if (slots_.empty())
+        return -1;
+    auto it = slots_.find(buf.data());
+    return it == slots_.end() ? -1 : it->second;
+}
+
+#endif
@@ -67,11 +67,90 @@ Json::ArrayJson* Json::ArrayJson::make(int n) {
     return new((void*) buf) ArrayJson(cap);
 }
 
+Json::ArrayJson* Json::ArrayJson::make(int n, Json_arena* arena) {
+    void* buf;
+    if (arena && (buf = arena->allocate(sizeof(ArrayJson) + n * sizeof(Json))))
+        return new(buf) ArrayJson(n, true);
+    else
+        return make(n);
+}
+
 void Json::ArrayJson::destroy(ArrayJson* aj) {
-    if (aj)
+    if (aj) {
         for (int i = 0; i != aj->size; ++i)
             aj->a[i].~Json();
-    delete[] reinterpret_cast<char*>(aj);
+        deallocate(aj);
+    }
+}
+
+void Json::ArrayJson::deallocate(ArrayJson* aj) {
+    if (aj->in_arena)
+        Json_arena::release(aj);
+    else
+        delete[] reinterpret_cast<char*>(aj);
+}
+
+
+// Arena internals
+
+Json_arena::~Json_arena() {
+    while (block* b = blocks_) {
+        blocks_ = b->next;
+        if (b->live)
+            b->retired = true;
+        else
+            free(b);
+    }
+}
+
+/** @brief Make the arena's storage available for reuse.
+
+    Blocks still holding live arrays are handed off to those arrays, and
+    freed when the last of them is. */
+void Json_arena::reset() {
+    block** pp = &blocks_;
+    while (block* b = *pp)
+        if (b->live) {
+            *pp = b->next;
+            b->retired = true;
+        } else
+            pp = &b->next;
+    cur_ = 0;
+    pos_ = end_ = 0;
+}
+
+void* Json_arena::allocate(size_t size) {
+    size = (size + 15) & ~size_t(15);
+    if (size > size_t(end_ - pos_)) {
+        if (size > max_item)
+            return 0;
+        block* b = cur_ ? cur_->next : blocks_;
+        if (!b) {
+            // blocks are aligned so release() can find them
+            void* p;
+            if (posix_memalign(&p, block_size, block_size) != 0)
+                return 0;
+            b = reinterpret_cast<block*>(p);
+            b->next = 0;
+            b->live = 0;
+            b->retired = false;
+            (cur_ ? cur_->next : blocks_) = b;
+        }
+        cur_ = b;
+        pos_ = reinterpret_cast<char*>(b) + ((sizeof(block) + 15) & ~15);
+        end_ = reinterpret_cast<char*>(b) + block_size;
+    }
+    void* p = pos_;
+    pos_ += size;
+    ++cur_->live;
+    return p;
+}
+
+void Json_arena::release(void* p) {
+    block* b = reinterpret_cast<block*>
+        (reinterpret_cast<uintptr_t>(p) & ~uintptr_t(block_size - 1));
+    if (--b->live == 0 && b->retired)
+        free(b);
 }
 
 
@@ -247,7 +326,7 @@ void Json::hard_uniqueify_array(bool convert, int ncap_in) {
     if (old_u.x.type == j_array && old_u.a.x && old_u.a.x->refcount == 1) {
         u_.a.x->size = old_u.a.x->size;
         memcpy(u_.a.x->a, old_u.a.x->a, sizeof(Json) * u_.a.x->size);
-        delete[] reinterpret_cast<char*>(old_u.a.x);
+        ArrayJson::deallocate(old_u.a.x);
     } else if (old_u.x.type == j_array && old_u.a.x) {
         u_.a.x->size = old_u.a.x->size;
         Json* last = u_.a.x->a + u_.a.x->size;
@@ -27,6 +27,7 @@ template <typename T> class Json_object_proxy;
 template <typename T> class Json_object_str_proxy;
 template <typename T> class Json_array_proxy;
 class Json_get_proxy;
+class Json_arena;
 
 template <typename T, size_t S = sizeof(String::rep_type) - sizeof(T)>
 struct Json_rep_item;
@@ -96,7 +97,7 @@ class Json {
 
     static inline const Json& make_null();
     static inline Json make_array();
-    static inline Json make_array_reserve(int n);
+    static inline Json make_array_reserve(int n, Json_arena* arena = 0);
     template <typename... Args>
     static inline Json array(Args&&... rest);
     static inline Json make_object();
@@ -418,14 +419,17 @@ class Json {
 
 struct Json::ArrayJson : public ComplexJson {
     int capacity;
+    bool in_arena;
     Json a[0];
 
-    inline ArrayJson(int cap)
-        : capacity(cap) {
+    inline ArrayJson(int cap, bool arena = false)
+        : capacity(cap), in_arena(arena) {
         size = 0;
     }
     static ArrayJson* make(int n);
+    static ArrayJson* make(int n, Json_arena* arena);
     static void destroy(ArrayJson* a);
+    static void deallocate(ArrayJson* a);
 };
 
 struct Json::ObjectItem {
@@ -477,6 +481,58 @@ struct Json::ObjectJson : public ComplexJson {
     void rehash();
 };
 
+
+/** @class Json_arena
+    @brief Bump allocator for the arrays of decoded Json.
+
+    Parsers given a Json_arena allocate array storage from it: one pointer
+    bump per array instead of one heap allocation. reset() makes all
+    storage available again at once. Arrays still alive at reset(), or
+    when the arena is destroyed, are safe; each keeps its block of
+    storage until it is freed, and copies-on-write into heap storage if
+    it needs to grow or is modified while shared. Objects are always
+    allocated on the heap. A Json_arena is not thread safe. */
+class Json_arena {
+  public:
+    inline Json_arena();
+    ~Json_arena();
+
+    void reset();
+
+    inline size_t nblocks() const;
+
+  private:
+    enum { block_size = 1 << 16, max_item = block_size / 8 };
+    struct block {
+        block* next;
+        unsigned live;          // arena arrays allocated in this block
+        bool retired;           // no arena owns this block
+    };
+    block* blocks_;
+    block* cur_;
+    char* pos_;
+    char* end_;
+
+    void* allocate(size_t size);
+    static void release(void* p);
+
+    Json_arena(const Json_arena&) = delete;
+    Json_arena& operator=(const Json_arena&) = delete;
+    friend class Json;
+};
+
+inline Json_arena::Json_arena()
+    : blocks_(0), cur_(0), pos_(0), end_(0) {
+}
+
+/** @brief Return the number of storage blocks the arena owns. */
+inline size_t Json_arena::nblocks() const {
+    size_t n = 0;
+    for (block* b = blocks_; b; b = b->next)
+        ++n;
+    return n;
+}
+
 inline const Json& Json::make_null() {
     return null_json;
 }
@@ -1614,11 +1670,13 @@ inline Json Json::array(Args&&... args) {
     j.push_back_list(std::forward<Args>(args)...);
     return j;
 }
-/** @brief Return an empty array-valued Json with reserved space for @a n items. */
-inline Json Json::make_array_reserve(int n) {
+/** @brief Return an empty array-valued Json with reserved space for @a n items.
+
+    If @a arena is nonnull, the space is allocated from @a arena. */
+inline Json Json::make_array_reserve(int n, Json_arena* arena) {
     Json j;
     j.u_.a.type = j_array;
-    j.u_.a.x = n ? ArrayJson::make(n) : 0;
+    j.u_.a.x = n ? ArrayJson::make(n, arena) : 0;
     return j;
 }
 /** @brief Return an empty object-valued Json. */
@@ -0,0 +1,198 @@
+// -*- mode: c++ -*-
+#include "mpaccept.hh"
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#if defined(__linux__)
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
+
+msgpack_acceptor::msgpack_acceptor() {
+    construct();
+}
+
+msgpack_acceptor::msgpack_acceptor(tamer::fd sfd) {
+    construct();
+    initialize(std::move(sfd));
+}
+
+void msgpack_acceptor::construct() {
+    batch_ = default_batch;
+    rate_ = burst_ = tokens_ = tokens_at_ = 0;
+    naccepted_ = nbatches_ = nthrottled_ = nerrors_ = 0;
+    max_batch_ = max_ready_ = 0;
+}
+
+msgpack_acceptor::~msgpack_acceptor() {
+    kill_();
+    wake_();
+    for (auto& e : waiting_)
+        e(tamer::fd());
+}
+
+/** @brief Start accepting connections on the listening socket @a sfd. */
+void msgpack_acceptor::initialize(tamer::fd sfd) {
+    assert(!sfd_ && !kill_);
+    sfd_ = std::move(sfd);
+    if (sfd_) {
+        int f = fcntl(sfd_.value(), F_GETFL);
+        if (f >= 0 && !(f & O_NONBLOCK))
+            fcntl(sfd_.value(), F_SETFL, f | O_NONBLOCK);
+        acceptor_coroutine();
+    }
+}
+
+/** @brief Accept at most @a rate connections per second on average.
+
+    Up to @a burst connections may be accepted at once after a quiet
+    period. A @a rate of 0 removes the limit. */
+void msgpack_acceptor::set_rate_limit(double rate, unsigned burst) {
+    assert(rate >= 0 && (rate == 0 || burst > 0));
+    rate_ = rate;
+    burst_ = tokens_ = burst;
+    tokens_at_ = tamer::dnow();
+}
+
+/** @brief Return the next connection through @a done.
+
+    @a done receives an invalid fd if the listening socket fails or the
+    msgpack_acceptor is destroyed. */
+void msgpack_acceptor::accept(tamer::event<tamer::fd> done) {
+    if (!ready_.empty()) {
+        done(std::move(ready_.front()));
+        ready_.pop_front();
+    } else if (sfd_) {
+        waiting_.push_back(std::move(done));
+        wake_();
+    } else
+        done(sfd_);
+}
+
+void msgpack_acceptor::refill() {
+    double now = tamer::dnow();
+    tokens_ = std::min(tokens_ + (now - tokens_at_) * rate_, burst_);
+    tokens_at_ = now;
+}
+
+/** Accept connections until the backlog is empty, the batch or the rate
+    limit is used up, or an error occurs. Returns the number accepted;
+    sets @a err to the error, if any. */
+size_t msgpack_acceptor::accept_batch(int& err) {
+    size_t n = 0;
+    err = 0;
+    while (n < batch_ && (!rate_ || tokens_ >= 1)) {
+#if HAVE_ACCEPT4
+        int f = ::accept4(sfd_.value(), nullptr, nullptr,
+                          SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+        int f = ::accept(sfd_.value(), nullptr, nullptr);
+        if (f >= 0) {
+            fcntl(f, F_SETFL, fcntl(f, F_GETFL) | O_NONBLOCK);
+            fcntl(f, F_SETFD, FD_CLOEXEC);
+        }
+#endif
+        if (f >= 0) {
+            ready_.push_back(tamer::fd(f));
+            ++n;
+            if (rate_)
+                tokens_ -= 1;
+        } else if (errno == EINTR || errno == ECONNABORTED)
+            continue;
+        else {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                ++nerrors_;
+                err = errno;
+            }
+            break;
+        }
+    }
+    if (n) {
+        naccepted_ += n;
+        ++nbatches_;
+        max_batch_ = std::max(max_batch_, n);
+        max_ready_ = std::max(max_ready_, ready_.size());
+    }
+    return n;
+}
+
+void msgpack_acceptor::deliver() {
+    while (!ready_.empty() && !waiting_.empty()) {
+        waiting_.front()(std::move(ready_.front()));
+        waiting_.pop_front();
+        ready_.pop_front();
+    }
+}
+
+tamed void msgpack_acceptor::acceptor_coroutine() {
+    tvars {
+        tamer::event<> kill;
+        tamer::rendezvous<> rendez;
+        size_t n;
+        int err;
+    }
+
+    kill = kill_ = tamer::make_event(rendez);
+
+    while (kill && sfd_) {
+        deliver();
+        if (waiting_.empty()) {
+            // leave connections in the backlog until someone wants one
+            twait { wake_ = make_event(); }
+            continue;
+        }
+        if (rate_) {
+            refill();
+            if (tokens_ < 1) {
+                ++nthrottled_;
+                twait { tamer::at_delay((1 - tokens_) / rate_, make_event()); }
+                continue;
+            }
+        }
+
+        n = accept_batch(err);
+        if (err == EMFILE || err == ENFILE || err == ENOBUFS || err == ENOMEM)
+            // out of descriptors or memory; connections wait in the
+            // backlog until some are freed
+            twait { tamer::at_delay(0.1, make_event()); }
+        else if (err) {
+            sfd_.close(-err);
+            break;
+        } else if (n == batch_)
+            // more may be pending; let the new connections run first
+            twait { tamer::at_asap(make_event()); }
+        else if (n == 0)
+            twait { tamer::at_fd_read(sfd_.value(), make_event()); }
+    }
+
+    if (kill) {
+        deliver();
+        for (auto& e : waiting_)
+            e(sfd_);
+        waiting_.clear();
+        kill();                 // avoid leak of active event
+    }
+}
+
+Json msgpack_acceptor::status() const {
+    Json j = Json::object("accepted", naccepted_,
+                          "batches", nbatches_,
+                          "max_batch", max_batch_,
+                          "ready", ready_.size(),
+                          "max_ready", max_ready_,
+                          "waiting", waiting_.size(),
+                          "throttled", nthrottled_,
+                          "errors", nerrors_);
+    if (rate_)
+        j.set("rate_limit", rate_).set("tokens", tokens_);
+#if defined(__linux__) && defined(TCP_INFO)
+    // for a listening TCP socket, Linux reports the accept queue length
+    // in tcpi_unacked and its limit in tcpi_sacked
+    struct tcp_info ti;
+    socklen_t tilen = sizeof(ti);
+    if (sfd_ && getsockopt(sfd_.value(), IPPROTO_TCP, TCP_INFO,
+                           &ti, &tilen) == 0)
+        j.set("backlog", ti.tcpi_unacked).set("backlog_limit", ti.tcpi_sacked);
+#endif
+    return j;
+}
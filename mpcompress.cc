@@ -0,0 +1,216 @@
+#include "mpcompress.hh"
+#include <algorithm>
+#include <limits.h>
+#include <string.h>
+#if HAVE_ZLIB_H && HAVE_LIBZ
+#include <zlib.h>
+#endif
+
+namespace mpcompress {
+namespace {
+
+// Each lz sequence is a token byte, whose high nibble is the literal
+// count and low nibble the match length minus 4; the literals; and,
+// unless the input ends after the literals, a 2-byte little-endian
+// match offset. A nibble of 15 continues in following bytes, each
+// adding up to 255.
+enum { hash_bits = 12, min_match = 4, max_offset = 65535 };
+
+// Neither codec expands its input more than this: deflate's limit is
+// 1032:1 and lz's about 255:1. A claimed length beyond it, or beyond what
+// a StringAccum can hold, is corrupt.
+enum { max_ratio = 1032, max_length = INT_MAX / 2 };
+
+inline uint32_t load32(const char* s) {
+    uint32_t x;
+    memcpy(&x, s, 4);
+    return x;
+}
+
+inline void append_length(StringAccum& out, size_t n) {
+    for (; n >= 255; n -= 255)
+        out << (char) 255;
+    out << (char) n;
+}
+
+void append_sequence(StringAccum& out, const char* lit, size_t nlit,
+                     size_t offset, size_t mlen) {
+    size_t mcode = mlen ? mlen - min_match : 0;
+    out << (char) ((std::min(nlit, size_t(15)) << 4)
+                   | std::min(mcode, size_t(15)));
+    if (nlit >= 15)
+        append_length(out, nlit - 15);
+    out.append(lit, nlit);
+    if (mlen) {
+        out << (char) offset << (char) (offset >> 8);
+        if (mcode >= 15)
+            append_length(out, mcode - 15);
+    }
+}
+
+void lz_compress(const char* s, size_t len, StringAccum& out) {
+    uint32_t table[1 << hash_bits];
+    memset(table, 0, sizeof(table));
+    size_t anchor = 0, i = 0;
+    while (i + min_match <= len) {
+        uint32_t seq = load32(s + i);
+        uint32_t h = (seq * 2654435761U) >> (32 - hash_bits);
+        size_t cand = table[h];
+        table[h] = i;
+        if (cand < i && i - cand <= max_offset && load32(s + cand) == seq) {
+            size_t mlen = min_match;
+            while (i + mlen < len && s[cand + mlen] == s[i + mlen])
+                ++mlen;
+            append_sequence(out, s + anchor, i - anchor, i - cand, mlen);
+            i += mlen;
+            anchor = i;
+        } else
+            ++i;
+    }
+    append_sequence(out, s + anchor, len - anchor, 0, 0);
+}
+
+inline bool read_length(const unsigned char*& s, const unsigned char* end,
+                        size_t& n) {
+    unsigned char c;
+    do {
+        if (s == end)
+            return false;
+        c = *s++;
+        n += c;
+    } while (c == 255);
+    return true;
+}
+
+bool lz_decompress(const char* data, size_t len, int original_len,
+                   StringAccum& out) {
+    const unsigned char* s = reinterpret_cast<const unsigned char*>(data);
+    const unsigned char* end = s + len;
+    char* first = out.extend(original_len);
+    if (!first && original_len)
+        return false;
+    char* d = first;
+    char* dend = first + original_len;
+    while (s != end) {
+        unsigned token = *s++;
+        size_t nlit = token >> 4;
+        if (nlit == 15 && !read_length(s, end, nlit))
+            return false;
+        if (nlit > size_t(end - s) || nlit > size_t(dend - d))
+            return false;
+        memcpy(d, s, nlit);
+        d += nlit;
+        s += nlit;
+        if (s == end)
+            break;
+
+        if (end - s < 2)
+            return false;
+        size_t offset = s[0] | (s[1] << 8);
+        s += 2;
+        size_t mlen = token & 15;
+        if (mlen == 15 && !read_length(s, end, mlen))
+            return false;
+        mlen += min_match;
+        if (offset == 0 || offset > size_t(d - first)
+            || mlen > size_t(dend - d))
+            return false;
+        // matches may overlap their own output
+        const char* m = d - offset;
+        for (size_t k = 0; k != mlen; ++k)
+            d[k] = m[k];
+        d += mlen;
+    }
+    return d == dend;
+}
+
+} // namespace
+
+const char* name(int codec) {
+    if (codec == lz)
+        return "lz";
+    else if (codec == zlib)
+        return "zlib";
+    else
+        return "none";
+}
+
+int find(Str name) {
+    if (name == "lz")
+        return lz;
+    else if (name == "zlib" && available(zlib))
+        return zlib;
+    else
+        return none;
+}
+
+bool available(int codec) {
+#if HAVE_ZLIB_H && HAVE_LIBZ
+    return codec == lz || codec == zlib;
+#else
+    return codec == lz;
+#endif
+}
+
+/** @brief Append the @a codec compression of [@a data, @a data + @a len)
+    to @a out.
+
+    Returns false, leaving @a out unchanged, if the codec is unavailable
+    or the result would be no smaller than the input. */
+bool compress(int codec, const char* data, size_t len, StringAccum& out) {
+    int old_len = out.length();
+    if (codec == lz)
+        lz_compress(data, len, out);
+#if HAVE_ZLIB_H && HAVE_LIBZ
+    else if (codec == zlib) {
+        uLongf zlen = compressBound(len);
+        char* x = out.reserve(zlen);
+        if (!x || compress2(reinterpret_cast<Bytef*>(x), &zlen,
+                            reinterpret_cast<const Bytef*>(data), len,
+                            Z_BEST_SPEED) != Z_OK)
+            return false;
+        out.adjust_length(zlen);
+    }
+#endif
+    else
+        return false;
+    if (size_t(out.length() - old_len) >= len) {
+        out.set_length(old_len);
+        return false;
+    }
+    return true;
+}
+
+/** @brief Append the decompression of [@a data, @a data + @a len) to
+    @a out.
+
+    Returns false, leaving @a out unchanged, if the data is corrupt or
+    does not decompress to exactly @a original_len bytes. @a original_len
+    may come from an untrusted peer; a length no codec could produce from
+    @a len bytes is rejected before anything is allocated. */
+bool decompress(int codec, const char* data, size_t len,
+                size_t original_len, StringAccum& out) {
+    if (original_len > size_t(max_length) - out.length()
+        || original_len / max_ratio > len)
+        return false;
+    int n = original_len;
+    int old_len = out.length();
+    bool ok = false;
+    if (codec == lz)
+        ok = lz_decompress(data, len, n, out);
+#if HAVE_ZLIB_H && HAVE_LIBZ
+    else if (codec == zlib) {
+        uLongf zlen = n;
+        char* x = out.extend(n);
+        ok = x && uncompress(reinterpret_cast<Bytef*>(x), &zlen,
+                             reinterpret_cast<const Bytef*>(data),
+                             len) == Z_OK
+            && zlen == uLongf(n);
+    }
+#endif
+    if (!ok)
+        out.set_length(old_len);
+    return ok;
+}
+
+} // namespace mpcompress
@@ -0,0 +1,28 @@
+// -*- mode: c++ -*-
+#ifndef MPRPC_MPCOMPRESS_HH
+#define MPRPC_MPCOMPRESS_HH
+#include "straccum.hh"
+#include "str.hh"
+
+// mpcompress: codecs for compressing msgpack_fd frames.
+//
+// The built-in "lz" codec is a byte-oriented LZ77 in the style of LZ4:
+// fast enough to run on every large frame, with modest ratios. "zlib"
+// compresses harder and is available when the library was found at
+// configure time. Neither format carries its own length; callers store
+// the uncompressed length beside the compressed bytes.
+
+namespace mpcompress {
+
+enum { none = 0, lz = 1, zlib = 2 };
+
+const char* name(int codec);
+int find(Str name);
+bool available(int codec);
+
+bool compress(int codec, const char* data, size_t len, StringAccum& out);
+bool decompress(int codec, const char* data, size_t len,
+                size_t original_len, StringAccum& out);
+
+} // namespace mpcompress
+#endif
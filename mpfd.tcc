@@ -1,30 +1,147 @@
 // -*- mode: c++ -*-
 #include "mpfd.hh"
+#include "uring.hh"
+#include <fcntl.h>
 #include <limits.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#if HAVE_LINUX_ERRQUEUE_H
+#include <linux/errqueue.h>
+#endif
+#if HAVE_LINUX_ERRQUEUE_H && defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY)
+#define MPFD_ZEROCOPY 1
+#include <sys/epoll.h>
+#endif
 #include <tamer/adapter.hh>
 #ifndef IOV_MAX
 #define IOV_MAX 1024
 #endif
 
+namespace {
+uring* mpfd_uring;
+tamer::event<> mpfd_uring_wake;
+
+void mpfd_uring_complete(uint64_t data, int res, unsigned) {
+    // cancellations have data == 0; their targets complete separately
+    if (data)
+        reinterpret_cast<tamer::event<int>*>(data)->trigger(res);
+}
+
+void mpfd_uring_unregister(int slot) {
+    mpfd_uring->unregister_buffer(slot);
+}
+
+// Some kernels complete io_uring reads of O_NONBLOCK files with -EAGAIN
+// instead of waiting for data, which costs a completion, a readiness
+// wait and a resubmission per idle read. Files handed to the ring are
+// made blocking; the ring itself never blocks on them.
+void mpfd_set_nonblocking(const tamer::fd& f, bool nonblocking) {
+    int flags = f ? fcntl(f.value(), F_GETFL) : -1;
+    if (flags >= 0 && bool(flags & O_NONBLOCK) != nonblocking)
+        fcntl(f.value(), F_SETFL, flags ^ O_NONBLOCK);
+}
+
+inline void mpfd_uring_kick() {
+    if (mpfd_uring_wake)
+        tamer::at_preblock(std::move(mpfd_uring_wake));
+}
+
+inline double mpfd_clock() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+}
+
+tamed void mpfd_uring_submitter() {
+    while (mpfd_uring) {
+        twait { mpfd_uring_wake = make_event(); }
+        mpfd_uring->submit();
+    }
+}
+
+tamed void mpfd_uring_reaper() {
+    while (mpfd_uring) {
+        twait { tamer::at_fd_read(mpfd_uring->fd(), make_event()); }
+        mpfd_uring->reap(mpfd_uring_complete);
+    }
+}
+
+/** @brief Use io_uring for msgpack_fds initialized from now on.
+
+    Returns false if io_uring is unavailable, in which case msgpack_fds
+    continue to use readiness notification. */
+bool msgpack_fd::enable_io_uring(unsigned entries) {
+    if (!mpfd_uring) {
+        uring* u = new uring;
+        if (!u->initialize(entries)) {
+            delete u;
+            return false;
+        }
+        mpfd_uring = u;
+        mpfd_uring_submitter();
+        mpfd_uring_reaper();
+    }
+    return true;
+}
+
+msgpack_fd::admission_state msgpack_fd::global_admission_;
+msgpack_fd::read_scheduler msgpack_fd::scheduler_;
+
 void msgpack_fd::reset() {
     wrpos_ = 0;
     wrsize_ = 0;
     wrblocked_ = false;
+    wrdelaying_ = false;
     rdpos_ = 0;
     rdlen_ = 0;
-    rdquota_ = rdbatch;
+    // lease no read buffer until the peer sends something: after a
+    // reconnect storm most new connections sit idle for a while
+    rdquota_ = 0;
+    rdpoll_ = true;
     rdreply_seq_ = 0;
+    wrcredited_ = false;
+    wrcredit_bytes_ = wrcredit_msgs_ = 0;
+    rdreturn_bytes_ = rdwindow_bytes_;  // granted in full on initialize
+    rdreturn_msgs_ = rdwindow_msgs_;
+    rdmsgsize_ = 0;
+    wrcodec_ = mpcompress::none;
 }
 
 void msgpack_fd::construct() {
+    rdwindow_bytes_ = rdwindow_msgs_ = 0;
     reset();
     wrlowat_ = 1 << 12;
     wrtotal_ = 0;
-    rdbuf_ = String::make_uninitialized(rdcap);
+    wrcalls_ = 0;
+    wrhint_ = 0;
+    wrpolicy_ = flush_asap;
+    wrdelay_ = 0;
     rdtotal_ = 0;
+    rdhint_ = 0;
+    rdraw_ = false;
+    uring_ = false;
+    rdop_ = wrop_ = nullptr;
+    wrinflight_ = 0;
+    wrpacelim_ = 1 << 20;
+    rdpacelim_ = 1 << 14;
+    rdqbytes_ = 0;
+    rdqlim_ = rdqbytelim_ = 0;
+    rdqpolicy_ = admit_pause;
+    rdrejected_ = 0;
+    rddeficit_ = 0;
+    rdweight_ = 1;
+    rdcodec_ = mpcompress::none;
+    wrzthresh_ = 0;
+    wrzcthresh_ = 0;
+    wrzcseq_ = 0;
+    wrzcsends_ = wrzccopied_ = 0;
+    wrzstats_ = rdzstats_ = compress_stats{0, 0, 0, 0};
 
+    // buffers are leased when there is data to move
     wrelem_.push_back(wrelem());
-    wrelem_.back().sa.reserve(wrcap);
     wrelem_.back().pos = 0;
 }
 
@@ -32,17 +149,197 @@ void msgpack_fd::initialize(tamer::fd rfd, tamer::fd wfd) {
     assert(!wfd_ && !rfd_ && !wrkill_ && !rdkill_ && !wrwake_ && !rdwake_);
     wfd_ = std::move(wfd);
     rfd_ = std::move(rfd);
+    uring_ = mpfd_uring != nullptr;
+    if (uring_) {
+        mpfd_set_nonblocking(rfd_, false);
+        mpfd_set_nonblocking(wfd_, false);
+    }
     writer_coroutine();
     reader_coroutine();
+    if (rdwindow_msgs_)
+        send_credit();
+    if (rdcodec_)
+        write(Json::array("compress", mpcompress::name(rdcodec_)), false);
+}
+
+/** @brief Limit what the peer may send with a credit window.
+
+    The peer may have at most @a bytes bytes and @a messages messages
+    outstanding: sent to us, but not yet delivered by read() or matched
+    to a call(). Credit comes back as messages are delivered. The peer
+    must be a msgpack_fd that also calls set_credit_window(); its pace()
+    blocks while its credit is used up, though its write() still sends.
+    Both limits must be positive.
+
+    The window may be changed at any time. A smaller window takes effect
+    as outstanding messages are delivered. Credit messages themselves are
+    not counted; they have the form ["credit", BYTES, MESSAGES], so once
+    a window is set, applications must not send messages of that form.
+    Before then, such messages are delivered like any other, so set the
+    window before initialize(). */
+void msgpack_fd::set_credit_window(size_t bytes, size_t messages) {
+    assert(bytes > 0 && messages > 0);
+    rdreturn_bytes_ += (long long) bytes - (long long) rdwindow_bytes_;
+    rdreturn_msgs_ += (long long) messages - (long long) rdwindow_msgs_;
+    rdwindow_bytes_ = bytes;
+    rdwindow_msgs_ = messages;
+    send_credit();
+}
+
+void msgpack_fd::send_credit() {
+    if (!wfd_ || (rdreturn_bytes_ <= 0 && rdreturn_msgs_ <= 0))
+        return;
+    long long bytes = std::max(rdreturn_bytes_, 0LL);
+    long long msgs = std::max(rdreturn_msgs_, 0LL);
+    rdreturn_bytes_ -= bytes;
+    rdreturn_msgs_ -= msgs;
+    write(Json::array("credit", bytes, msgs), false);
+}
+
+/** @brief Compress large frames exchanged with the peer.
+
+    Asks the peer to compress frames it sends us with @a codec, and
+    compresses frames of at least @a threshold bytes that we send, using
+    the codec the peer asks for. The peer must be a msgpack_fd that also
+    calls set_compression(); until it does, frames go uncompressed. A
+    frame that does not shrink is sent as is.
+
+    Until set_compression() is called, the peer's compression messages
+    are delivered like any other message, so call it before initialize().
+    Afterwards a compressed frame in any codec but @a codec, or one that
+    does not decompress to a whole message, closes the connection. */
+void msgpack_fd::set_compression(int codec, size_t threshold) {
+    assert(mpcompress::available(codec) && threshold > 0);
+    rdcodec_ = codec;
+    wrzthresh_ = threshold;
+    if (wfd_)
+        write(Json::array("compress", mpcompress::name(codec)), false);
+}
+
+/** Handle a control message. Returns true if @a j was consumed; a
+    compressed frame is replaced by its contents, or consumed and the
+    connection closed if it is corrupt. */
+bool msgpack_fd::receive_control(Json& j) {
+    const String& kind = j[0].as_s();
+    if (kind == "credit" && rdwindow_msgs_) {
+        wrcredited_ = true;
+        wrcredit_bytes_ += std::max(j[1].to_i(), int64_t(0));
+        wrcredit_msgs_ += std::max(j[2].to_i(), int64_t(0));
+        if (pace_recovered())
+            pacer_();
+        return true;
+    } else if (kind == "compress" && rdcodec_) {
+        wrcodec_ = j[1].is_s() ? mpcompress::find(j[1].as_s())
+                               : int(mpcompress::none);
+        return true;
+    } else if (kind == "compressed" && rdcodec_) {
+        // only the codec we asked for is accepted
+        if (j[1].is_i() && j[1].as_i() == rdcodec_ && decompress_frame(j))
+            return false;
+        protocol_error();
+        return true;
+    } else
+        return false;
+}
+
+void msgpack_fd::compress_frame(StringAccum& sa, int pos) {
+    size_t len = sa.length() - pos;
+    double start = mpfd_clock();
+    StringAccum z;
+    buffer_pool::global().lease(z, len);
+    if (mpcompress::compress(wrcodec_, sa.data() + pos, len, z)) {
+        sa.set_length(pos);
+        msgpack::unparser<StringAccum> mu(sa);
+        mu << msgpack::array(4) << Str("compressed") << wrcodec_ << len
+           << Str(z.data(), z.length());
+        ++wrzstats_.frames;
+        wrzstats_.raw += len;
+        wrzstats_.compressed += sa.length() - pos;
+    }
+    buffer_pool::global().release(z);
+    wrzstats_.time += mpfd_clock() - start;
+}
+
+/** Replace the compressed frame @a j by the message it holds. Returns
+    false if the payload does not decompress to exactly one message. */
+bool msgpack_fd::decompress_frame(Json& j) {
+    double start = mpfd_clock();
+    size_t len = j[2].is_nonnegint() ? j[2].to_u() : 0;
+    StringAccum sa;
+    bool ok = j.size() == 4 && j[3].is_s() && len > 0
+        && mpcompress::decompress(rdcodec_, j[3].as_s().data(),
+                                  j[3].as_s().length(), len, sa);
+    if (ok) {
+        String frame = sa.take_string();
+        ++rdzstats_.frames;
+        rdzstats_.raw += frame.length();
+        rdzstats_.compressed += j[3].as_s().length();
+        msgpack::streaming_parser sp;
+        ok = sp.consume(frame.begin(), frame.end(), frame) == frame.end()
+            && sp.success();
+        if (ok) {
+            swap(j, sp.result());
+            if (rdraw_)
+                rdrawframe_ = frame;
+        }
+    }
+    rdzstats_.time += mpfd_clock() - start;
+    return ok;
+}
+
+/** Close the connection after a frame that cannot be decoded. The
+    reader then exits, completing outstanding calls and reads with
+    null. */
+void msgpack_fd::protocol_error() {
+    rfd_.close(-EPROTO);
+    rdquota_ = 0;
+    check_coroutines();
+}
+
+Json msgpack_fd::compression_status() const {
+    if (!rdcodec_ && !wrcodec_)
+        return Json();
+    return Json::object("codec", mpcompress::name(rdcodec_),
+                        "peer_codec", mpcompress::name(wrcodec_),
+                        "threshold", wrzthresh_,
+                        "send_frames", wrzstats_.frames,
+                        "send_raw", wrzstats_.raw,
+                        "send_compressed", wrzstats_.compressed,
+                        "send_time", wrzstats_.time,
+                        "recv_frames", rdzstats_.frames,
+                        "recv_raw", rdzstats_.raw,
+                        "recv_compressed", rdzstats_.compressed,
+                        "recv_time", rdzstats_.time);
 }
 
 void msgpack_fd::destroy() {
+    // in-flight io_uring operations own their buffers; cancel them so
+    // their coroutines can exit
+    if (rdop_)
+        mpfd_uring->prepare_cancel((uintptr_t) &rdop_->done, 0);
+    if (wrop_)
+        mpfd_uring->prepare_cancel((uintptr_t) &wrop_->done, 0);
+    if (rdop_ || wrop_)
+        mpfd_uring_kick();
+    rdop_ = wrop_ = nullptr;
+    if (uring_) {
+        mpfd_set_nonblocking(rfd_, true);
+        mpfd_set_nonblocking(wfd_, true);
+    }
+    wrinflight_ = 0;
     wrkill_();
     rdkill_();
     wrwake_();
     rdwake_();
     clear_write();
     clear_read();
+    clear_queue();
+    release_write_buffers();
+    wrzc_.clear();              // the connection is going away
+    if (wrzcfd_)
+        wrzcfd_.close();
+    buffer_pool::global().release(rdbuf_);
+    rdpos_ = rdlen_ = 0;
 }
 
 void msgpack_fd::clear() {
@@ -50,9 +347,10 @@ void msgpack_fd::clear() {
     wfd_ = rfd_ = tamer::fd();
     while (wrelem_.size() > 1)
         wrelem_.pop_front();
-    wrelem_[0].sa.clear();
     wrelem_[0].pos = 0;
-    rdreqq_.clear();
+    rdrawsa_.clear();
+    rdrawframe_ = String();
+    rdscanner_.reset();
     reset();
 }
 
@@ -74,6 +372,13 @@ void msgpack_fd::clear_read() {
     rdreplywait_.clear();
 }
 
+void msgpack_fd::clear_queue() {
+    global_admission_.requests -= rdreqq_.size();
+    global_admission_.bytes -= rdqbytes_;
+    rdreqq_.clear();
+    rdqbytes_ = 0;
+}
+
 msgpack_fd::~msgpack_fd() {
     destroy();
 }
@@ -83,45 +388,74 @@ void msgpack_fd::write(const Json& j, bool iscall) {
     if (!wfd_)
         return;
 
-    // find StringAccum to write into
+    // find StringAccum to write into; start a new one when this one is
+    // within 1/64 of its capacity
     wrelem* w = &wrelem_.back();
-    if (w->sa.length() >= wrhiwat) {
+    if (w->sa.capacity() <= 0)
+        buffer_pool::global().lease(w->sa, wrhint_);
+    else if (w->sa.length() >= w->sa.capacity() - (w->sa.capacity() >> 6)) {
         wrelem_.push_back(wrelem());
         w = &wrelem_.back();
-        w->sa.reserve(wrcap);
+        buffer_pool::global().lease(w->sa, wrhint_);
         w->pos = 0;
     }
     int old_len = w->sa.length();
 
-    // serialize Json to w->sa
-    msgpack::unparser<StringAccum> mu(w->sa);
+    // serialize Json to w->sa, sized first so it's reserved only once
+    char* x;
     if (iscall && j[1].is_null()) { // assign sequence number
-        mu << msgpack::array(std::max(j.size(), 2)) << j[0]
-           << (rdreply_seq_ + rdreplywait_.size());
+        char hdr[5], seq[9];
+        size_t hdrlen = msgpack::format::write_array_header
+            (hdr, std::max(j.size(), 2)) - hdr;
+        size_t seqlen = msgpack::format::write_int
+            (seq, rdreply_seq_ + rdreplywait_.size()) - seq;
+        size_t size = hdrlen + msgpack::encoded_size(j[0]) + seqlen;
+        for (int i = 2; i < j.size(); ++i)
+            size += msgpack::encoded_size(j[i]);
+        x = w->sa.reserve(size);
+        memcpy(x, hdr, hdrlen);
+        x = msgpack::write_unchecked(x + hdrlen, j[0]);
+        memcpy(x, seq, seqlen);
+        x += seqlen;
         for (int i = 2; i < j.size(); ++i)
-            mu << j[i];
+            x = msgpack::write_unchecked(x, j[i]);
     } else {
         if (iscall && rdreplywait_.empty())
             rdreply_seq_ = j[1].as_u();
-        mu << j;
+        x = w->sa.reserve(msgpack::encoded_size(j));
+        x = msgpack::write_unchecked(x, j);
     }
+    w->sa.set_end(x);
+
+    // compress large frames if the peer asked for it
+    if (wrcodec_ && wrzthresh_
+        && size_t(w->sa.length() - old_len) >= wrzthresh_ && !is_control(j))
+        compress_frame(w->sa, old_len);
 
     // write (if over low-water mark), wake coroutine
     wrsize_ += w->sa.length() - old_len;
     wrtotal_ += w->sa.length() - old_len;
-    if (wrsize_ >= wrlowat_ && !wrblocked_)
-        write_once();
-    if (wrsize_ > 0 && wrwake_) {
-        tamer::at_asap(std::move(wrwake_));
+    if (wrcredited_ && !is_control(j)) {
+        wrcredit_bytes_ -= w->sa.length() - old_len;
+        --wrcredit_msgs_;
+    }
+    if (wrpolicy_ == flush_asap) {
+        if (wrsize_ >= wrlowat_ && !wrblocked_ && !uring_)
+            write_once();
+        if (wrsize_ > 0 && wrwake_) {
+            tamer::at_asap(std::move(wrwake_));
+            assert(!wrwake_);
+        }
+    } else if (wrwake_ && (!wrdelaying_ || wrsize_ >= wrlowat_)) {
+        // coalesce: send at the end of this event loop pass
+        tamer::at_preblock(std::move(wrwake_));
         assert(!wrwake_);
     }
 }
 
 void msgpack_fd::read(tamer::event<Json> receiver) {
     if (!rdreqq_.empty()) {
-        if (receiver)
-            swap(*receiver.result_pointer(), rdreqq_.front());
-        rdreqq_.pop_front();
+        pop_request(receiver ? receiver.result_pointer() : nullptr);
         receiver.unblock();
     } else if (read_until_request(true)) {
         if (receiver)
@@ -144,6 +478,45 @@ void msgpack_fd::flush(tamer::event<> done) {
     flush(tamer::rebind<bool>(done));
 }
 
+/** @brief Share reading fairly among msgpack_fds.
+
+    By default each reader processes up to 1024 messages whenever its
+    input is ready, so a few pipelining peers can delay everyone else.
+    With a nonzero @a quantum, connections with input take turns in
+    deficit round robin: each turn lets a connection process
+    read_weight() * @a quantum bytes or messages, depending on @a unit,
+    and a connection that exceeds its share waits for every other
+    connection to have a turn. A @a quantum of 0 turns scheduling off. */
+void msgpack_fd::set_read_quantum(size_t quantum, int unit) {
+    assert(unit == quantum_messages || unit == quantum_bytes);
+    scheduler_.quantum = quantum;
+    scheduler_.unit = unit;
+    if (!quantum)
+        while (!scheduler_.waiting.empty()) {
+            scheduler_.waiting.front()();
+            scheduler_.waiting.pop_front();
+        }
+}
+
+void msgpack_fd::wait_read_turn(tamer::event<> e) {
+    if (!scheduler_.busy) {
+        scheduler_.busy = true;
+        e();
+    } else
+        scheduler_.waiting.push_back(std::move(e));
+}
+
+void msgpack_fd::end_read_turn() {
+    // hand the turn straight to the next waiter, so newcomers queue
+    // behind it
+    if (scheduler_.waiting.empty())
+        scheduler_.busy = false;
+    else {
+        scheduler_.waiting.front()();
+        scheduler_.waiting.pop_front();
+    }
+}
+
 inline void msgpack_fd::check_coroutines() {
     if (rdquota_ == 0 || !rfd_)
         rdwake_();
@@ -157,37 +530,88 @@ bool msgpack_fd::read_one_message() {
  readmore:
     // if buffer empty, read more data
     if (rdpos_ == rdlen_) {
-        // make new buffer or reuse existing buffer
-        if (rdcap - rdpos_ < 4096) {
-            if (rdbuf_.is_shared())
-                rdbuf_ = String::make_uninitialized(rdcap);
-            rdpos_ = rdlen_ = 0;
+        prepare_read_buffer();
+
+        if (uring_) {
+            // the reader coroutine reads through io_uring
+            rdquota_ = 0;
+            check_coroutines();
+            return false;
         }
 
-        ssize_t amt = ::read(rfd_.value(),
-                             const_cast<char*>(rdbuf_.data()) + rdpos_,
-                             rdcap - rdpos_);
+        size_t room = rdbuf_.length() - rdlen_;
+        size_t direct = rdraw_ ? 0 : rdparser_.string_remaining();
+        ssize_t amt;
+        if (direct >= rddirect) {
+            // read more of a large string straight into the space its
+            // buffer already has, and whatever follows into rdbuf_
+            struct iovec iov[2];
+            iov[0].iov_base = rdparser_.string_buffer();
+            iov[0].iov_len = direct;
+            iov[1].iov_base = const_cast<char*>(rdbuf_.data()) + rdlen_;
+            iov[1].iov_len = room;
+            amt = readv(rfd_.value(), iov, 2);
+            if (amt > 0) {
+                size_t n = std::min((size_t) amt, direct);
+                rdparser_.string_filled(n);
+                rdtotal_ += n;
+                rdmsgsize_ += n;
+                amt -= n;
+                if (amt == 0)   // let consume() finish the string
+                    goto process;
+            }
+        } else
+            amt = ::read(rfd_.value(),
+                         const_cast<char*>(rdbuf_.data()) + rdlen_, room);
 
         if (amt != 0 && amt != (ssize_t) -1) {
             rdlen_ += amt;
             rdtotal_ += amt;
+            note_read(amt, room);
         } else {
             if (amt == 0)
                 rfd_.close();
             else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
                 rfd_.close(-errno);
+            release_read_buffer();  // idle: hand the buffer back
             rdquota_ = 0;
             check_coroutines(); // wake up coroutine [if it's sleeping]
             return false;
         }
     }
 
+ process:
     // process new data
-    rdpos_ += rdparser_.consume(rdbuf_.begin() + rdpos_, rdlen_ - rdpos_,
-                                rdbuf_);
+    const char* first = rdbuf_.begin() + rdpos_;
+    bool done;
+    if (rdraw_) {
+        // find the end of the encoded message without decoding it; share
+        // rdbuf_ if it fits in one read
+        bool fresh = rdscanner_.empty();
+        size_t took = rdscanner_.consume(first, rdlen_ - rdpos_);
+        rdpos_ += took;
+        rdmsgsize_ += took;
+        done = rdscanner_.done();
+        if (fresh && done)
+            rdrawframe_ = rdbuf_.fast_substring(first, first + took);
+        else {
+            rdrawsa_.append(first, took);
+            if (done)
+                rdrawframe_ = rdrawsa_.take_string();
+        }
+        if (done)
+            finish_raw_frame();
+    } else {
+        size_t took = rdparser_.consume(first, rdlen_ - rdpos_, rdbuf_);
+        rdpos_ += took;
+        rdmsgsize_ += took;
+        done = rdparser_.done();
+    }
 
-    if (rdparser_.done()) {
+    if (done) {
         --rdquota_;
+        if (scheduler_.quantum)
+            rddeficit_ -= scheduler_.unit == quantum_bytes ? rdmsgsize_ : 1;
         if (rdquota_ == 0)
             rdwake_();          // wake up coroutine [if it's sleeping]
         return true;
@@ -195,6 +619,97 @@ bool msgpack_fd::read_one_message() {
         goto readmore;
 }
 
+/** Set the parser result for the raw frame in rdrawframe_. Requests stay
+    encoded; replies and control messages, which msgpack_fd handles
+    itself, are decoded. */
+void msgpack_fd::finish_raw_frame() {
+    Json& result = rdparser_.result();
+    msgpack::parser p(rdrawframe_);
+    unsigned n;
+    long code;
+    if (!rdscanner_.success())
+        result = Json();        // XXX reset connection
+    else if (p.try_read_array_header(n) && n != 0
+             && p.try_read_int(code) && code >= 0)
+        result = rdrawframe_;
+    else
+        result = msgpack::parse(rdrawframe_);
+    rdscanner_.reset();
+}
+
+inline size_t msgpack_fd::adapt_hint(size_t hint, size_t amt) {
+    // grow at once, shrink slowly
+    return amt >= hint ? amt : hint - (hint - amt) / 8;
+}
+
+void msgpack_fd::note_read(size_t amt, size_t room) {
+    // a read that fills the buffer means messages want a bigger one
+    rdhint_ = adapt_hint(rdhint_, amt == room ? 2 * amt : amt);
+}
+
+/** Make room to read into rdbuf_, leasing a buffer sized at twice the
+    recent read size. A buffer still shared with parsed strings is read
+    into past its used part, if enough room is left. */
+void msgpack_fd::prepare_read_buffer() {
+    assert(rdpos_ == rdlen_);
+    size_t want = buffer_pool::size_class(2 * rdhint_);
+    if (rdbuf_.is_shared() ? rdbuf_.length() - rdpos_ < want / 4
+                           : rdbuf_.length() != want) {
+        buffer_pool::global().release(rdbuf_);
+        rdbuf_ = buffer_pool::global().lease(want);
+        rdpos_ = rdlen_ = 0;
+    } else if (!rdbuf_.is_shared())
+        rdpos_ = rdlen_ = 0;
+}
+
+void msgpack_fd::release_read_buffer() {
+    assert(rdpos_ == rdlen_);
+    // delivered messages' strings usually still share rdbuf_; the pool
+    // then leaves it to be freed with them (its "shared" count)
+    buffer_pool::global().release(rdbuf_);
+    rdpos_ = rdlen_ = 0;
+}
+
+msgpack_fd::uring_op* msgpack_fd::start_uring_read(tamer::event<int> done) {
+    assert(!rdop_ && rdpos_ == rdlen_);
+    uring_op* op = rdop_ = new uring_op;
+    op->done = std::move(done);
+    op->rdbuf = rdbuf_;
+
+    // pool buffers stay registered from lease to lease; a buffer the
+    // kernel will not register is read without a slot
+    buffer_pool& pool = buffer_pool::global();
+    int slot = pool.slot(rdbuf_);
+    if (slot < 0 && mpfd_uring->has_fixed_buffers()) {
+        slot = mpfd_uring->register_buffer(rdbuf_.data(), rdbuf_.length());
+        if (slot >= 0)
+            pool.set_slot(rdbuf_, slot, mpfd_uring_unregister);
+    }
+
+    if (mpfd_uring->prepare_read(rfd_.value(),
+                                 const_cast<char*>(rdbuf_.data()) + rdlen_,
+                                 rdbuf_.length() - rdlen_,
+                                 (uintptr_t) &op->done, slot))
+        mpfd_uring_kick();
+    else
+        op->done(-EAGAIN);
+    return op;
+}
+
+void msgpack_fd::finish_uring_read(int amt) {
+    rdop_ = nullptr;
+    if (amt > 0) {
+        note_read(amt, rdbuf_.length() - rdlen_);
+        rdlen_ += amt;
+        rdtotal_ += amt;
+        return;
+    } else if (amt == 0)
+        rfd_.close();
+    else if (amt != -EAGAIN && amt != -EINTR)
+        rfd_.close(amt);
+    release_read_buffer();
+}
+
 tamed void msgpack_fd::reader_coroutine() {
     // NB The msgpack_fd::coroutines may outlive the msgpack_fd itself. They
     // are programmed to survive the deletion of the msgpack_fd by checking
@@ -204,6 +719,9 @@ tamed void msgpack_fd::reader_coroutine() {
     tvars {
         tamer::event<> kill;
         tamer::rendezvous<> rendez;
+        uring_op* op;
+        int amt;
+        bool turn;
     }
 
     kill = rdkill_ = tamer::make_event(rendez);
@@ -211,18 +729,43 @@ tamed void msgpack_fd::reader_coroutine() {
     while (kill && rfd_) {
         if (rdquota_ == 0 && rdpos_ != rdlen_)
             twait { tamer::at_asap(make_event()); }
-        else if (rdquota_ == 0)
+        else if (rdquota_ == 0 && uring_ && !rdpoll_) {
+            twait { op = start_uring_read(make_event(amt)); }
+            delete op;
+            if (kill)
+                finish_uring_read(amt);
+            if (kill && amt == -EAGAIN)
+                twait { tamer::at_fd_read(rfd_.value(), make_event()); }
+        } else if (rdquota_ == 0) {
             twait { tamer::at_fd_read(rfd_.value(), make_event()); }
-        else if (rdreqwait_.empty() && rdreplywait_.empty())
+            if (kill)
+                rdpoll_ = false;
+        } else if (!want_read())
             twait { rdwake_ = make_event(); }
 
         if (!kill)
             break;
 
+        turn = scheduler_.quantum && want_read();
+        if (turn) {
+            twait { wait_read_turn(make_event()); }
+            if (!kill) {
+                end_read_turn();
+                break;
+            }
+            rddeficit_ += (long long) scheduler_.quantum * rdweight_;
+        }
+
         rdquota_ = rdbatch;
-        while (rdquota_ && (!rdreqwait_.empty() || !rdreplywait_.empty())
+        while (rdquota_ && want_read() && (!turn || rddeficit_ > 0)
                && read_one_message())
             dispatch(false);
+        if (turn) {
+            // unused share is not saved up across idle periods
+            if (rddeficit_ > 0)
+                rddeficit_ = 0;
+            end_read_turn();
+        }
         if (pace_recovered())
             pacer_();
     }
@@ -235,11 +778,16 @@ tamed void msgpack_fd::reader_coroutine() {
 
 bool msgpack_fd::dispatch(bool exit_on_request) {
     Json& result = rdparser_.result();
-    if (!rdparser_.success())
+    size_t size = rdmsgsize_;
+    rdmsgsize_ = 0;
+    if (!rdraw_ && !rdparser_.success())
         result = Json();        // XXX reset connection
     rdparser_.reset();
+    if (result.is_a() && result[0].is_s() && receive_control(result))
+        return false;
     if (result.is_a() && result[0].is_i() && result[1].is_i()
         && result[0].as_i() < 0) {
+        consumed(size);
         unsigned long seq = result[1].as_i();
         if (seq >= rdreply_seq_ && seq < rdreply_seq_ + rdreplywait_.size()) {
             replyelem& done = rdreplywait_[seq - rdreply_seq_];
@@ -252,21 +800,65 @@ bool msgpack_fd::dispatch(bool exit_on_request) {
             }
         }
         return false;
-    } else if (!rdreqwait_.empty()) {
+    }
+
+    if (rdreqwait_.empty() && !exit_on_request
+        && rdqpolicy_ == admit_reject && !admits(size) && reject(result)) {
+        rdrawframe_ = String();
+        consumed(size);
+        return false;
+    }
+
+    if (rdraw_) {
+        if (result)
+            result = rdrawframe_;
+        rdrawframe_ = String();
+    }
+    if (!rdreqwait_.empty()) {
         tamer::event<Json>& done = rdreqwait_.front();
         if (done.result_pointer())
             swap(*done.result_pointer(), result);
         done.unblock();
         rdreqwait_.pop_front();
+        consumed(size);
         return false;
-    } else if (exit_on_request)
+    } else if (exit_on_request) {
+        consumed(size);
         return true;
-    else {
-        rdreqq_.push_back(std::move(result));
+    } else {
+        // credit returns when read() delivers it
+        rdreqq_.push_back(reqelem{std::move(result), size});
+        rdqbytes_ += size;
+        ++global_admission_.requests;
+        global_admission_.bytes += size;
         return false;
     }
 }
 
+/** Answer @a req with an "overloaded" error instead of queueing it.
+    Returns false if @a req is not a request. */
+bool msgpack_fd::reject(const Json& req) {
+    if (rdraw_ && req.is_s())
+        return reject(msgpack::parse(req.as_s()));
+    if (!req.is_a() || req.size() < 2 || !req[0].is_i() || req[0].as_i() <= 0)
+        return false;
+    write(Json::array(-req[0].as_i(), req[1],
+                      Json::object("error", "overloaded")), false);
+    ++rdrejected_;
+    ++global_admission_.rejected;
+    return true;
+}
+
+/** @brief Return the process-wide admission limits and counters. */
+Json msgpack_fd::admission_status() {
+    const admission_state& g = global_admission_;
+    return Json::object("queued", g.requests,
+                        "queued_bytes", g.bytes,
+                        "max_queued", g.max_requests,
+                        "max_queued_bytes", g.max_bytes,
+                        "rejected", g.rejected);
+}
+
 void msgpack_fd::check() const {
     // document invariants
     assert(!wrelem_.empty());
@@ -279,12 +871,151 @@ void msgpack_fd::check() const {
     if (wrelem_.size() == 1)
         assert(wrelem_[0].pos < wrelem_[0].sa.length()
                || wrelem_[0].sa.empty());
-    size_t wrsize = 0;
+    size_t wrsize = wrinflight_;
     for (auto& w : wrelem_)
         wrsize += w.sa.length() - w.pos;
     assert(wrsize == wrsize_);
 }
 
+inline void msgpack_fd::notify_written() {
+    // data sent with zerocopy counts once the kernel is done with it
+    size_t wpos = wrzc_.empty() ? wrpos_ : wrzc_.front().wpos;
+    while (!flushelem_.empty()
+           && (ssize_t) (wpos - flushelem_.front().wpos) >= 0) {
+        flushelem_.front().e.trigger(true);
+        flushelem_.pop_front();
+    }
+    if (pace_recovered())
+        pacer_();
+}
+
+void msgpack_fd::release_write_buffers() {
+    for (auto& w : wrelem_)
+        buffer_pool::global().release(w.sa);
+}
+
+/** Release a chunk that has been sent. While zerocopy sends are
+    pending, the kernel may still be reading it, so it is held until
+    the newest of them completes. */
+inline void msgpack_fd::release_sent(StringAccum& sa) {
+    if (wrzc_.empty())
+        buffer_pool::global().release(sa);
+    else if (sa.capacity() > 0)
+        wrzc_.back().bufs.push_back(std::move(sa));
+}
+
+/** @brief Send large writes with MSG_ZEROCOPY.
+
+    Sends of at least @a threshold bytes are made with MSG_ZEROCOPY, so
+    the kernel transmits straight from our buffers instead of copying
+    them. A buffer is reused only after the kernel reports the send
+    complete, and flush() waits for that report too. Returns false if
+    the socket does not support zerocopy. If the kernel reports that it
+    copied the data anyway, as it does over loopback, zerocopy is turned
+    off again. A @a threshold of 0 turns zerocopy off. Call after
+    initialize(); not used with io_uring. */
+bool msgpack_fd::set_zerocopy(size_t threshold) {
+#if MPFD_ZEROCOPY
+    int one = 1;
+    if (threshold && !wrzcthresh_
+        && (!wfd_ || setsockopt(wfd_.value(), SOL_SOCKET, SO_ZEROCOPY,
+                                &one, sizeof(one)) != 0))
+        return false;
+    wrzcthresh_ = threshold;
+    return true;
+#else
+    return !threshold;
+#endif
+}
+
+/** Set up wrzcfd_, an epoll fd that becomes readable when zerocopy
+    completions arrive on wfd_'s error queue. wfd_ is watched for no
+    events, so only its error and hangup conditions are reported, and
+    edge-triggered, so data waiting to be read does not wake the writer.
+    Returns false if there is no such fd. */
+bool msgpack_fd::watch_zerocopy() {
+#if MPFD_ZEROCOPY
+    if (!wrzcfd_) {
+        int efd = epoll_create1(EPOLL_CLOEXEC);
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLET;
+        if (efd >= 0
+            && epoll_ctl(efd, EPOLL_CTL_ADD, wfd_.value(), &ev) == 0)
+            wrzcfd_ = tamer::fd(efd);
+        else if (efd >= 0)
+            ::close(efd);
+    }
+#endif
+    return wrzcfd_.valid();
+}
+
+void msgpack_fd::reap_zerocopy() {
+#if MPFD_ZEROCOPY
+    if (wrzcfd_) {
+        // rearm the edge-triggered watch before reading the queue
+        struct epoll_event ev;
+        epoll_wait(wrzcfd_.value(), &ev, 1, 0);
+    }
+    char control[128];
+    while (!wrzc_.empty()) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(wfd_.value(), &msg, MSG_ERRQUEUE) == -1)
+            break;
+        for (struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm;
+             cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR)
+                  || (cm->cmsg_level == SOL_IPV6
+                      && cm->cmsg_type == IPV6_RECVERR)))
+                continue;
+            struct sock_extended_err ee;
+            memcpy(&ee, CMSG_DATA(cm), sizeof(ee));
+            if (ee.ee_errno != 0 || ee.ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+            // sends ee_info through ee_data are complete
+            for (auto& z : wrzc_)
+                if (z.seq - ee.ee_info <= ee.ee_data - ee.ee_info)
+                    z.done = true;
+            if (ee.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                ++wrzccopied_;
+                wrzcthresh_ = 0;    // no gain; fall back to copying
+            }
+        }
+    }
+#endif
+    bool any = false;
+    while (!wrzc_.empty() && wrzc_.front().done) {
+        for (auto& sa : wrzc_.front().bufs)
+            buffer_pool::global().release(sa);
+        wrzc_.pop_front();
+        any = true;
+    }
+    if (any)
+        notify_written();
+}
+
+Json msgpack_fd::zerocopy_status() const {
+    if (!wrzcthresh_ && !wrzcsends_)
+        return Json();
+    return Json::object("threshold", wrzcthresh_,
+                        "sends", wrzcsends_,
+                        "pending", wrzc_.size(),
+                        "copied", wrzccopied_);
+}
+
+size_t msgpack_fd::send_capacity() const {
+    size_t cap = 0;
+    for (auto& w : wrelem_)
+        cap += std::max(w.sa.capacity(), 0);
+    if (wrop_)
+        for (auto& w : wrop_->wr)
+            cap += std::max(w.sa.capacity(), 0);
+    return cap;
+}
+
 void msgpack_fd::write_once() {
     // check();
     assert(!wrelem_.front().sa.empty());
@@ -298,12 +1029,42 @@ void msgpack_fd::write_once() {
         total += iov[i].iov_len;
     }
 
-    ssize_t amt;
+    if (!wrzc_.empty())
+        reap_zerocopy();
+
+    ssize_t amt = -1;
+    bool zc = false;
+#if MPFD_ZEROCOPY
+    if (wrzcthresh_ && total >= wrzcthresh_) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iov_count;
+        amt = sendmsg(wfd_.value(), &msg, MSG_ZEROCOPY);
+        zc = amt > 0;
+        if (amt == -1 && errno == ENOBUFS)
+            amt = writev(wfd_.value(), iov, iov_count);
+    } else
+#endif
     if (iov_count > 1)
         amt = writev(wfd_.value(), iov, iov_count);
     else
         amt = ::write(wfd_.value(), iov[0].iov_base, iov[0].iov_len);
+    ++wrcalls_;
+    if (zc) {
+        // the kernel reads these chunks until it reports completion:
+        // hold them, and keep write() from appending to (and perhaps
+        // reallocating) the last one
+        wrzc_.push_back(zcsend{wrzcseq_++, wrpos_, false, {}});
+        ++wrzcsends_;
+        if (iov_count == (int) wrelem_.size()
+            && !wrelem_.back().sa.empty()) {
+            wrelem_.push_back(wrelem());
+            wrelem_.back().pos = 0;
+        }
+    }
     wrblocked_ = amt == 0 || amt == (ssize_t) -1;
+    wrhint_ = adapt_hint(wrhint_, wrsize_);
 
     if (amt != 0 && amt != (ssize_t) -1) {
         wrpos_ += amt;
@@ -311,21 +1072,17 @@ void msgpack_fd::write_once() {
         while (wrelem_.size() > 1
                && amt >= wrelem_.front().sa.length() - wrelem_.front().pos) {
             amt -= wrelem_.front().sa.length() - wrelem_.front().pos;
+            release_sent(wrelem_.front().sa);
             wrelem_.pop_front();
         }
         wrelem_.front().pos += amt;
         if (wrelem_.front().pos == wrelem_.front().sa.length()) {
+            // all sent: the connection is idle, so give up its buffer
             assert(wrelem_.size() == 1);
-            wrelem_.front().sa.clear();
+            release_sent(wrelem_.front().sa);
             wrelem_.front().pos = 0;
         }
-        while (!flushelem_.empty()
-               && (ssize_t) (wrpos_ - flushelem_.front().wpos) >= 0) {
-            flushelem_.front().e.trigger(true);
-            flushelem_.pop_front();
-        }
-        if (pace_recovered())
-            pacer_();
+        notify_written();
     } else {
         if (amt == 0)
             wfd_.close();
@@ -335,6 +1092,80 @@ void msgpack_fd::write_once() {
     }
 }
 
+msgpack_fd::uring_op* msgpack_fd::start_uring_write(tamer::event<int> done) {
+    assert(!wrop_ && wrinflight_ == 0);
+    uring_op* op = wrop_ = new uring_op;
+    op->done = std::move(done);
+    wrhint_ = adapt_hint(wrhint_, wrsize_);
+
+    // move chunks to the operation, so write() never touches memory
+    // the kernel is reading
+    int n = 0;
+    while (n != uring_op::niov && !wrelem_.empty()
+           && wrelem_.front().pos != wrelem_.front().sa.length()) {
+        op->wr.push_back(std::move(wrelem_.front()));
+        wrelem_.pop_front();
+        wrelem& w = op->wr.back();
+        op->iov[n].iov_base = w.sa.data() + w.pos;
+        op->iov[n].iov_len = w.sa.length() - w.pos;
+        wrinflight_ += op->iov[n].iov_len;
+        ++n;
+    }
+    if (wrelem_.empty()) {
+        wrelem_.push_back(wrelem());  // write() leases a buffer
+        wrelem_.back().pos = 0;
+    }
+
+    if (mpfd_uring->prepare_writev(wfd_.value(), op->iov, n,
+                                   (uintptr_t) &op->done))
+        mpfd_uring_kick();
+    else
+        op->done(-EAGAIN);
+    return op;
+}
+
+void msgpack_fd::finish_uring_write(uring_op* op, int amt) {
+    wrop_ = nullptr;
+    wrinflight_ = 0;
+
+    if (amt > 0) {
+        wrpos_ += amt;
+        wrsize_ -= amt;
+        int left = amt;
+        // sent chunks go back to the pool; no spare is kept here
+        while (!op->wr.empty()
+               && left >= op->wr.front().sa.length() - op->wr.front().pos) {
+            left -= op->wr.front().sa.length() - op->wr.front().pos;
+            buffer_pool::global().release(op->wr.front().sa);
+            op->wr.pop_front();
+        }
+        if (!op->wr.empty())
+            op->wr.front().pos += left;
+    } else if (amt == 0)
+        wfd_.close();
+    else if (amt == -EAGAIN)
+        wrblocked_ = true;
+    else if (amt != -EINTR)
+        wfd_.close(amt);
+
+    // return unwritten chunks to the front of the queue
+    if (!op->wr.empty()) {
+        if (wrelem_.size() == 1 && wrelem_.front().sa.empty()) {
+            buffer_pool::global().release(wrelem_.front().sa);
+            wrelem_.pop_front();
+        }
+        while (!op->wr.empty()) {
+            wrelem_.push_front(std::move(op->wr.back()));
+            op->wr.pop_back();
+        }
+    }
+
+    if (amt > 0)
+        notify_written();
+    if (!wfd_)
+        check_coroutines();
+}
+
 tamed void msgpack_fd::writer_coroutine() {
     // NB The msgpack_fd::coroutines may outlive the msgpack_fd itself. They
     // are programmed to survive the deletion of the msgpack_fd by checking
@@ -344,19 +1175,49 @@ tamed void msgpack_fd::writer_coroutine() {
     tvars {
         tamer::event<> kill;
         tamer::rendezvous<> rendez;
+        bool delayed = false;
+        uring_op* op;
+        int amt;
     }
 
     kill = wrkill_ = tamer::make_event(rendez);
 
     while (kill && wfd_) {
-        if (wrelem_.size() == 1 && wrelem_.front().sa.empty())
+        if (wrelem_.size() == 1 && wrelem_.front().sa.empty()
+            && !wrzc_.empty()) {
+            // wait for zerocopy completions, or for more to write
+            if (watch_zerocopy())
+                twait {
+                    wrwake_ = make_event();
+                    tamer::at_fd_read(wrzcfd_.value(), wrwake_);
+                }
+            else
+                twait { wrwake_ = tamer::add_timeout(0.001, make_event()); }
+            if (kill)
+                reap_zerocopy();
+        } else if (wrelem_.size() == 1 && wrelem_.front().sa.empty())
             twait { wrwake_ = make_event(); }
         else if (wrblocked_) {
             twait { tamer::at_fd_write(wfd_.value(), make_event()); }
             if (kill)
                 wrblocked_ = false;
-        } else
-            write_once();
+        } else if (wrpolicy_ == flush_tick && wrdelay_ > 0 && !delayed
+                   && wrsize_ < wrlowat_) {
+            // wait out the delay budget unless wrlowat_ is reached first
+            delayed = wrdelaying_ = true;
+            twait { wrwake_ = tamer::add_timeout(wrdelay_, make_event()); }
+            if (kill)
+                wrdelaying_ = false;
+        } else {
+            if (uring_) {
+                twait { op = start_uring_write(make_event(amt)); }
+                if (kill)
+                    finish_uring_write(op, amt);
+                delete op;
+            } else
+                write_once();
+            delayed = false;
+        }
     }
 
     if (kill) {
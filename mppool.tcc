@@ -0,0 +1,215 @@
+// -*- mode: c++ -*-
+#include "mppool.hh"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdlib.h>
+
+msgpack_pool::msgpack_pool()
+    : rr_(0), hedge_delay_(0), min_backoff_(0.01), max_backoff_(5),
+      credit_bytes_(0), credit_msgs_(0), codec_(mpcompress::none),
+      codec_threshold_(1024), nhedged_(0), nhedge_wins_(0) {
+}
+
+msgpack_pool::~msgpack_pool() {
+    clear();
+}
+
+/** @brief Keep @a nconnections connections open to endpoint @a name. */
+void msgpack_pool::add_endpoint(Json name, unsigned nconnections) {
+    assert(name.is_o() && nconnections > 0);
+    endpoints_.push_back(endpoint{std::move(name), 0, 0, 0});
+    for (unsigned i = 0; i != nconnections; ++i) {
+        conns_.emplace_back(new conn);
+        conns_.back()->ep = &endpoints_.back();
+        run(conns_.back().get());
+    }
+}
+
+/** @brief Close all connections and forget all endpoints.
+
+    Calls waiting for a connection complete with a null reply. */
+void msgpack_pool::clear() {
+    for (auto& c : conns_)
+        c->kill();
+    conns_.clear();
+    endpoints_.clear();
+    while (!waiting_.empty()) {
+        waiting_.front().reply(Json());
+        waiting_.pop_front();
+    }
+}
+
+msgpack_pool::conn* msgpack_pool::pick(const endpoint* avoid) {
+    conn* best = nullptr;
+    size_t n = conns_.size();
+    for (size_t i = 0; i != n; ++i) {
+        conn* c = conns_[(rr_ + i) % n].get();
+        if (c->mpfd && c->ep != avoid
+            && (!best || c->mpfd.outstanding_calls()
+                         < best->mpfd.outstanding_calls()))
+            best = c;
+    }
+    ++rr_;                      // spread ties across connections
+    return best;
+}
+
+/** @brief Send the call @a req on the least loaded connection.
+
+    @a reply receives the reply, or null if the connection fails first.
+    If the pool has no endpoints, @a reply receives null at once. */
+void msgpack_pool::call(Json req, tamer::event<Json> reply) {
+    assert(req.is_a());
+    if (req.size() > 1)
+        req[1] = Json();
+    conn* c = pick(nullptr);
+    if (!c) {
+        if (conns_.empty())
+            reply(Json());
+        else
+            waiting_.push_back(pending{std::move(req), std::move(reply)});
+    } else {
+        ++c->ep->ncalls;
+        if (hedge_delay_ > 0 && endpoints_.size() > 1)
+            hedged_call(c, std::move(req), std::move(reply));
+        else
+            c->mpfd.call(req, std::move(reply));
+    }
+}
+
+tamed void msgpack_pool::hedged_call(conn* c, Json req,
+                                     tamer::event<Json> reply) {
+    tvars {
+        tamer::rendezvous<int> r;
+        Json res[2];
+        const endpoint* first = c->ep;
+        conn* h;
+        int which, nout = 1;
+    }
+
+    c->mpfd.call(req, tamer::make_event(r, 0, res[0]));
+    tamer::at_delay(hedge_delay_, tamer::make_event(r, -1));
+    while (1) {
+        twait(r, which);
+        if (which < 0) {
+            if ((h = pick(first))) {
+                ++h->ep->ncalls;
+                ++nhedged_;
+                h->mpfd.call(req, tamer::make_event(r, 1, res[1]));
+                ++nout;
+            }
+        } else if (!res[which].is_null() || --nout == 0)
+            break;
+    }
+
+    if (which == 1 && !res[1].is_null())
+        ++nhedge_wins_;
+    reply(std::move(res[which]));
+}
+
+tamed void msgpack_pool::open(Json name, tamer::event<tamer::fd> done) {
+    tvars { struct in_addr a; tamer::fd cfd; }
+
+    if (name["path"].is_s())
+        twait { tamer::unix_stream_connect(name["path"].to_s(),
+                                           tamer::make_event(cfd)); }
+    else if ((name["ip"].is_null() || name["ip"].is_s())
+             && name["port"].is_nonnegint()) {
+        if (name["ip"].is_null())
+            a.s_addr = htonl(INADDR_LOOPBACK);
+        else if (!inet_aton(name["ip"].to_s().c_str(), &a)) {
+            done(tamer::fd(-EINVAL));
+            return;
+        }
+        twait { tamer::tcp_connect(a, name["port"].to_u(),
+                                   tamer::make_event(cfd)); }
+    } else
+        cfd = tamer::fd(-EINVAL);
+    done(std::move(cfd));
+}
+
+tamed void msgpack_pool::run(conn* c) {
+    // The pool may be destroyed while this coroutine is blocked; `kill`
+    // is triggered when that happens, and `c` is then dead.
+    tvars {
+        tamer::event<> kill;
+        tamer::rendezvous<> rendez;
+        tamer::fd cfd;
+        Json msg;
+        double backoff;
+    }
+
+    kill = c->kill = tamer::make_event(rendez);
+    backoff = min_backoff_;
+
+    while (kill) {
+        twait { open(c->ep->name, make_event(cfd)); }
+        if (!kill)
+            break;
+        ++c->ep->nconnects;
+        if (!cfd) {
+            // jittered exponential backoff keeps reconnects from
+            // arriving in lockstep
+            ++c->ep->nfailures;
+            twait { tamer::at_delay(backoff * (0.5 + drand48() / 2),
+                                    make_event()); }
+            if (kill)
+                backoff = std::min(backoff * 2, max_backoff_);
+            continue;
+        }
+
+        backoff = min_backoff_;
+        if (credit_msgs_)
+            c->mpfd.set_credit_window(credit_bytes_, credit_msgs_);
+        if (codec_)
+            c->mpfd.set_compression(codec_, codec_threshold_);
+        c->mpfd.initialize(cfd);
+        while (!waiting_.empty() && c->mpfd) {
+            pending p = std::move(waiting_.front());
+            waiting_.pop_front();
+            call(std::move(p.req), std::move(p.reply));
+        }
+
+        // servers send only replies, so read() returns at close
+        do {
+            msg = Json();
+            twait { c->mpfd.read(make_event(msg)); }
+        } while (kill && msg);
+        if (kill)
+            c->mpfd.clear();
+    }
+
+    if (kill)
+        kill();                 // avoid leak of active event
+}
+
+size_t msgpack_pool::live_connections() const {
+    size_t n = 0;
+    for (auto& c : conns_)
+        n += c->mpfd.valid();
+    return n;
+}
+
+Json msgpack_pool::status() const {
+    Json ej = Json::make_array();
+    for (auto& ep : endpoints_) {
+        size_t live = 0, outstanding = 0;
+        for (auto& c : conns_)
+            if (c->ep == &ep && c->mpfd) {
+                ++live;
+                outstanding += c->mpfd.outstanding_calls();
+            }
+        ej.push_back(Json::object("name", ep.name,
+                                  "live", live,
+                                  "outstanding", outstanding,
+                                  "calls", ep.ncalls,
+                                  "connects", ep.nconnects,
+                                  "failures", ep.nfailures));
+    }
+    return Json::object("connections", conns_.size(),
+                        "live", live_connections(),
+                        "waiting", waiting_.size(),
+                        "hedge_delay", hedge_delay_,
+                        "hedged", nhedged_,
+                        "hedge_wins", nhedge_wins_,
+                        "endpoints", ej);
+}
@@ -1,53 +1,270 @@
 // -*- mode: c++ -*-
 #include "clp.h"
 #include "mpfd.hh"
+#include "mpserver.hh"
+#include "mppool.hh"
+#include "mpaccept.hh"
 #include <netdb.h>
+#include <math.h>
 
 static bool quiet = false;
-tamed void handle_client(tamer::fd cfd);
+static size_t credit_bytes = 0;
+static size_t credit_msgs = 0;
+static int codec = mpcompress::none;
+static size_t codec_threshold = 1024;
+static unsigned accept_batch = msgpack_acceptor::default_batch;
+static double accept_rate = 0;
 
-tamed void server(int port) {
+enum { dist_fixed, dist_uniform, dist_exponential };
+static const char* const dist_names[] = {"fixed", "uniform", "exponential"};
+static double load_duration = 0;
+static unsigned load_depth = 1;
+static double load_rate = 0;
+static size_t load_payload = 0;
+static int load_dist = dist_fixed;
+
+static void handle_request(Json, tamer::event<Json> done) {
+    done(Json::make_array());
+}
+
+static void handle_ping(msgpack::parser&, unsigned, tamer::event<Json> done) {
+    done(Json::make_array());
+}
+
+tamed void server(int port, msgpack_server& rpcs) {
     tvars {
         tamer::fd sfd = tamer::tcp_listen(port);
+        msgpack_acceptor acceptor;
         tamer::fd cfd;
     }
     if (sfd)
         std::cerr << "listening on port " << port << std::endl;
     else
         std::cerr << "listen: " << strerror(-sfd.error()) << std::endl;
-    while (sfd) {
-        twait { sfd.accept(make_event(cfd)); }
-        handle_client(cfd);
+    acceptor.set_batch(accept_batch);
+    if (accept_rate)
+        acceptor.set_rate_limit(accept_rate, accept_batch);
+    acceptor.initialize(sfd);
+    while (acceptor.valid()) {
+        twait { acceptor.accept(make_event(cfd)); }
+        if (cfd)
+            rpcs.serve(cfd);
     }
 }
 
-tamed void handle_client(tamer::fd cfd) {
-    tvars {
-        msgpack_fd mpfd(cfd);
-        Json req, res = Json::make_array();
+
+// Log-linear latency histogram in the style of HdrHistogram. Values
+// are microseconds; below 64 they are exact, and above they fall in 32
+// buckets per power of two, for about 3% precision.
+class latency_histogram {
+  public:
+    latency_histogram()
+        : b_(nbuckets, 0), n_(0), sum_(0), min_(~uint64_t(0)), max_(0) {
     }
+    void record(double seconds);
+    uint64_t percentile(double p) const;
+    Json status() const;
+  private:
+    enum { sub_bits = 5, nsub = 1 << sub_bits, max_bits = 40,
+           nbuckets = 2 * nsub + (max_bits - sub_bits - 1) * nsub };
+    std::vector<uint64_t> b_;
+    uint64_t n_;
+    uint64_t sum_;
+    uint64_t min_;
+    uint64_t max_;
+    static unsigned index(uint64_t v);
+    static uint64_t highest(unsigned i);
+};
 
-    while (cfd) {
-        twait { mpfd.read_request(make_event(req)); }
-        if (!req || !req.is_a() || req.size() < 2 || !req[0].is_i()) {
-            if (req)
-                std::cerr << "bad RPC: " << req << std::endl;
-            break;
+unsigned latency_histogram::index(uint64_t v) {
+    if (v < 2 * nsub)
+        return v;
+    int k = 63 - __builtin_clzll(v);
+    if (k >= max_bits) {
+        v = (uint64_t(1) << max_bits) - 1;
+        k = max_bits - 1;
+    }
+    return 2 * nsub + (k - sub_bits - 1) * nsub + (v >> (k - sub_bits)) - nsub;
+}
+
+uint64_t latency_histogram::highest(unsigned i) {
+    if (i < 2 * nsub)
+        return i;
+    unsigned j = i - 2 * nsub;
+    unsigned shift = j / nsub + 1;
+    return ((uint64_t(j % nsub + nsub) + 1) << shift) - 1;
+}
+
+void latency_histogram::record(double seconds) {
+    uint64_t v = seconds > 0 ? uint64_t(seconds * 1e6 + 0.5) : 0;
+    ++b_[index(v)];
+    ++n_;
+    sum_ += v;
+    min_ = std::min(min_, v);
+    max_ = std::max(max_, v);
+}
+
+uint64_t latency_histogram::percentile(double p) const {
+    uint64_t target = std::max(uint64_t(ceil(p / 100 * n_)), uint64_t(1));
+    uint64_t count = 0;
+    for (unsigned i = 0; i != b_.size(); ++i)
+        if ((count += b_[i]) >= target)
+            return std::min(highest(i), max_);
+    return max_;
+}
+
+Json latency_histogram::status() const {
+    if (!n_)
+        return Json::object("count", 0);
+    return Json::object("count", n_,
+                        "min", min_,
+                        "mean", double(sum_) / n_,
+                        "p50", percentile(50),
+                        "p90", percentile(90),
+                        "p99", percentile(99),
+                        "p99.9", percentile(99.9),
+                        "p99.99", percentile(99.99),
+                        "max", max_);
+}
+
+struct load_state {
+    double start;
+    double end;
+    unsigned active;
+    bool stopped;
+    unsigned long nok;
+    unsigned long nerrors;
+    String payload_buf;
+    latency_histogram latency;
+    tamer::event<> drained;
+
+    load_state();
+    Json request();
+    void record(const Json& res, double t0);
+    inline void finish();
+};
+
+load_state::load_state()
+    : start(tamer::dnow()), end(start + load_duration), active(0),
+      stopped(false), nok(0), nerrors(0) {
+    // exponential sizes are capped at 16 times the mean
+    size_t cap = load_payload * (load_dist == dist_fixed ? 1
+                                 : load_dist == dist_uniform ? 2 : 16);
+    payload_buf = String::make_fill('x', cap);
+}
+
+Json load_state::request() {
+    size_t n = load_payload;
+    if (load_dist == dist_uniform)
+        n = drand48() * (2 * load_payload + 1);
+    else if (load_dist == dist_exponential)
+        n = -log(1 - drand48()) * load_payload;
+    n = std::min(n, size_t(payload_buf.length()));
+    return Json::array(1, Json(), payload_buf.substring(payload_buf.begin(),
+                                                        payload_buf.begin() + n));
+}
+
+void load_state::record(const Json& res, double t0) {
+    if (res.is_a() && !(res[2].is_o() && res[2]["error"])) {
+        ++nok;
+        latency.record(tamer::dnow() - t0);
+    } else
+        ++nerrors;
+}
+
+inline void load_state::finish() {
+    if (--active == 0)
+        drained();
+}
+
+// closed loop: each worker keeps one call outstanding
+tamed void load_worker(msgpack_pool& pool, std::shared_ptr<load_state> st) {
+    tvars { Json res; double t0; }
+    while (!st->stopped && tamer::dnow() < st->end) {
+        t0 = tamer::dnow();
+        res = Json();
+        twait { pool.call(st->request(), make_event(res)); }
+        st->record(res, t0);
+    }
+    st->finish();
+}
+
+tamed void load_call(msgpack_pool& pool, std::shared_ptr<load_state> st,
+                     double t0) {
+    tvars { Json res; }
+    twait { pool.call(st->request(), make_event(res)); }
+    st->record(res, t0);
+    st->finish();
+}
+
+// open loop: Poisson arrivals at load_rate, whether or not earlier calls
+// have finished. Latency counts from each call's scheduled arrival, so a
+// stalled server is charged for the calls it delayed.
+tamed void load_generator(msgpack_pool& pool, std::shared_ptr<load_state> st) {
+    tvars { double next = st->start, now; unsigned burst = 0; }
+    while (!st->stopped && next < st->end) {
+        now = tamer::dnow();
+        if (next > now) {
+            burst = 0;
+            twait { tamer::at_delay(next - now, make_event()); }
+        } else if (++burst == 256) {
+            // running behind; let replies in
+            burst = 0;
+            twait { tamer::at_asap(make_event()); }
         }
+        if (st->stopped)
+            break;
+        ++st->active;
+        load_call(pool, st, next);
+        next += -log(1 - drand48()) / load_rate;
+    }
+    st->finish();
+}
+
+tamed void load(msgpack_pool& pool, unsigned nconn, tamer::event<> done) {
+    tvars {
+        std::shared_ptr<load_state> st = std::make_shared<load_state>();
+        unsigned i;
+        double elapsed;
+        Json j;
+    }
 
-        res[0] = -req[0].as_i();
-        res[1] = req[1];
-        mpfd.write(res);
+    // calls still unanswered 5 seconds after the run count as errors
+    twait {
+        st->drained = tamer::add_timeout(load_duration + 5, make_event());
+        if (load_rate > 0) {
+            ++st->active;
+            load_generator(pool, st);
+        } else
+            for (i = 0; i != nconn * load_depth; ++i) {
+                ++st->active;
+                load_worker(pool, st);
+            }
     }
+    st->stopped = true;
+    elapsed = tamer::dnow() - st->start;
 
-    cfd.close();
+    j = Json::object("mode", load_rate > 0 ? "open" : "closed",
+                     "connections", nconn,
+                     "duration", elapsed,
+                     "payload", load_payload,
+                     "payload_distribution", dist_names[load_dist],
+                     "requests", st->nok,
+                     "errors", st->nerrors + st->active,
+                     "throughput", st->nok / elapsed,
+                     "latency_us", st->latency.status());
+    if (load_rate > 0)
+        j.set("rate", load_rate);
+    else
+        j.set("depth", load_depth);
+    std::cout << j.unparse(Json::indent_depth(2)) << std::endl;
+    done();
 }
 
 
-tamed void client(const char* hostname, int port) {
+tamed void client(const char* hostname, int port, unsigned nconn) {
     tvars {
-        tamer::fd cfd;
-        msgpack_fd mpfd;
+        msgpack_pool pool;
         struct in_addr hostip;
         int i;
         Json req, res;
@@ -69,24 +286,38 @@ tamed void client(const char* hostname, int port) {
     }
 
     // connect
-    twait { tamer::tcp_connect(hostip, port, make_event(cfd)); }
-    if (!cfd) {
-        std::cerr << "connect " << (hostname ? hostname : "localhost")
-                  << ":" << port << ": " << strerror(-cfd.error()) << std::endl;
+    if (credit_bytes)
+        pool.set_credit_window(credit_bytes, credit_msgs);
+    if (codec)
+        pool.set_compression(codec, codec_threshold);
+    pool.add_endpoint(Json::object("ip", inet_ntoa(hostip), "port", port),
+                      nconn);
+
+    if (load_duration > 0) {
+        twait { load(pool, nconn, make_event()); }
+        pool.clear();
         return;
     }
-    mpfd.initialize(cfd);
 
     // pingpong 10 times
-    for (i = 0; i != 10 && cfd; ++i) {
+    for (i = 0; i != 10; ++i) {
         req = Json::array(1, i);
-        twait { mpfd.call(req, make_event(res)); }
+        res = Json();
+        twait { pool.call(req, tamer::add_timeout(5, make_event(res))); }
         if (!quiet)
             std::cout << "call " << req << ": " << res << std::endl;
+        if (res.is_null()) {
+            std::cerr << "call " << req << ": no reply from "
+                      << (hostname ? hostname : "localhost") << ":" << port
+                      << std::endl;
+            break;
+        }
     }
 
     // close out
-    cfd.close();
+    if (!quiet)
+        std::cout << pool.status() << std::endl;
+    pool.clear();
 }
 
 
@@ -95,7 +326,25 @@ static Clp_Option options[] = {
     { "listen", 'l', 0, 0, 0 },
     { "port", 'p', 0, Clp_ValInt, 0 },
     { "host", 'h', 0, Clp_ValString, 0 },
-    { "quiet", 'q', 0, 0, Clp_Negate }
+    { "quiet", 'q', 0, 0, Clp_Negate },
+    { "inflight", 'k', 0, Clp_ValUnsigned, 0 },
+    { "max-total-inflight", 0, 0, Clp_ValUnsigned, 0 },
+    { "fair", 0, 0, Clp_ValUnsigned, 0 },
+    { "compress", 'z', 0, Clp_ValString, Clp_Optional },
+    { "compress-threshold", 0, 0, Clp_ValUnsigned, 0 },
+    { "ordered", 0, 0, 0, Clp_Negate },
+    { "coalesce", 0, 0, Clp_ValDouble, Clp_Optional },
+    { "io-uring", 0, 0, 0, Clp_Negate },
+    { "credit", 0, 0, Clp_ValUnsigned, 0 },
+    { "credit-messages", 0, 0, Clp_ValUnsigned, 0 },
+    { "connections", 'n', 0, Clp_ValUnsigned, 0 },
+    { "duration", 'd', 0, Clp_ValDouble, 0 },
+    { "depth", 0, 0, Clp_ValUnsigned, 0 },
+    { "rate", 'r', 0, Clp_ValDouble, 0 },
+    { "payload", 0, 0, Clp_ValUnsigned, 0 },
+    { "payload-distribution", 0, 0, Clp_ValString, 0 },
+    { "accept-batch", 0, 0, Clp_ValUnsigned, 0 },
+    { "accept-rate", 0, 0, Clp_ValDouble, 0 }
 };
 
 int main(int argc, char** argv) {
@@ -104,6 +353,9 @@ int main(int argc, char** argv) {
     bool is_server = false;
     String hostname = "localhost";
     int port = 18029;
+    unsigned nconn = 1;
+    msgpack_server rpcs(handle_request);
+    rpcs.add_method(1, handle_ping);
     Clp_Parser* clp = Clp_NewParser(argc, argv, sizeof(options) / sizeof(options[0]), options);
 
     while (Clp_Next(clp) != Clp_Done) {
@@ -117,12 +369,73 @@ int main(int argc, char** argv) {
             hostname = clp->vstr;
         else if (Clp_IsLong(clp, "quiet"))
             quiet = !clp->negated;
+        else if (Clp_IsLong(clp, "inflight"))
+            rpcs.set_max_inflight(std::max(clp->val.u, 1U));
+        else if (Clp_IsLong(clp, "max-total-inflight"))
+            rpcs.set_max_total_inflight(clp->val.u);
+        else if (Clp_IsLong(clp, "fair"))
+            msgpack_fd::set_read_quantum(clp->val.u);
+        else if (Clp_IsLong(clp, "compress")) {
+            codec = clp->have_val ? mpcompress::find(clp->vstr)
+                                  : int(mpcompress::lz);
+            if (!codec)
+                std::cerr << "unknown compression " << clp->vstr << "\n";
+        } else if (Clp_IsLong(clp, "compress-threshold"))
+            codec_threshold = std::max(clp->val.u, 1U);
+        else if (Clp_IsLong(clp, "ordered"))
+            rpcs.set_ordered(!clp->negated);
+        else if (Clp_IsLong(clp, "coalesce"))
+            rpcs.set_flush_policy(msgpack_fd::flush_tick,
+                                  clp->have_val ? clp->val.d : 0);
+        else if (Clp_IsLong(clp, "credit"))
+            credit_bytes = clp->val.u;
+        else if (Clp_IsLong(clp, "credit-messages"))
+            credit_msgs = clp->val.u;
+        else if (Clp_IsLong(clp, "connections"))
+            nconn = std::max(clp->val.u, 1U);
+        else if (Clp_IsLong(clp, "duration"))
+            load_duration = clp->val.d;
+        else if (Clp_IsLong(clp, "depth"))
+            load_depth = std::max(clp->val.u, 1U);
+        else if (Clp_IsLong(clp, "rate"))
+            load_rate = clp->val.d;
+        else if (Clp_IsLong(clp, "payload"))
+            load_payload = clp->val.u;
+        else if (Clp_IsLong(clp, "payload-distribution")) {
+            String d = clp->vstr;
+            if (d == "fixed")
+                load_dist = dist_fixed;
+            else if (d == "uniform")
+                load_dist = dist_uniform;
+            else if (d == "exponential" || d == "exp")
+                load_dist = dist_exponential;
+            else
+                std::cerr << "unknown payload distribution " << d << "\n";
+        }
+        else if (Clp_IsLong(clp, "accept-batch"))
+            accept_batch = std::max(clp->val.u, 1U);
+        else if (Clp_IsLong(clp, "accept-rate"))
+            accept_rate = std::max(clp->val.d, 0.0);
+        else if (Clp_IsLong(clp, "io-uring") && !clp->negated) {
+            if (!msgpack_fd::enable_io_uring())
+                std::cerr << "io_uring unavailable, using readiness I/O\n";
+        }
     }
 
+    if (credit_bytes || credit_msgs) {
+        // a window needs both limits; default whichever is missing
+        credit_bytes = credit_bytes ? credit_bytes : 1 << 20;
+        credit_msgs = credit_msgs ? credit_msgs : 1024;
+        rpcs.set_credit_window(credit_bytes, credit_msgs);
+    }
+
+    if (codec)
+        rpcs.set_compression(codec, codec_threshold);
+
     if (is_server)
-        server(port);
+        server(port, rpcs);
     else
-        client(hostname.c_str(), port);
+        client(hostname.c_str(), port, nconn);
 
     tamer::loop();
     tamer::cleanup();
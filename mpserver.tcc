@@ -0,0 +1,200 @@
+// -*- mode: c++ -*-
+#include "mpserver.hh"
+
+tamed void msgpack_server::serve(tamer::fd cfd) {
+    tvars {
+        std::shared_ptr<connection> c = std::make_shared<connection>(cfd);
+        Json req;
+    }
+
+    ++nconnections_;
+    c->mpfd.set_raw_requests(!methods_.empty());
+    c->mpfd.set_flush_policy(flush_policy_, flush_delay_);
+    if (credit_msgs_)
+        c->mpfd.set_credit_window(credit_bytes_, credit_msgs_);
+    if (codec_)
+        c->mpfd.set_compression(codec_, codec_threshold_);
+    while (c->mpfd) {
+        while (c->inflight >= max_inflight_)
+            twait { c->slot = make_event(); }
+        twait { c->mpfd.pace(make_event()); }
+
+        req = Json();
+        twait { c->mpfd.read(make_event(req)); }
+        if (!check_request(req)) {
+            if (req)
+                std::cerr << "bad RPC: "
+                          << (req.is_s() ? msgpack::parse(req.as_s()) : req)
+                          << std::endl;
+            break;
+        }
+        if (max_total_inflight_ && ninflight_ >= max_total_inflight_) {
+            reject(*c, req);
+            continue;
+        }
+
+        ++c->inflight;
+        ++ninflight_;
+        ++nrequests_;
+        process(c, std::move(req));
+    }
+
+    while (c->inflight != 0)
+        twait { c->slot = make_event(); }
+    twait { c->mpfd.flush(make_event()); }
+    --nconnections_;
+    cfd.close();
+}
+
+void msgpack_server::add_method(long code, method_type handler,
+                                unsigned max_inflight) {
+    assert(code > 0 && !find_method(code));
+    methods_.emplace_back(code, std::move(handler), max_inflight);
+    if (code < nsmall_methods) {
+        if (small_methods_.empty())
+            small_methods_.resize(nsmall_methods, nullptr);
+        small_methods_[code] = &methods_.back();
+    } else
+        large_methods_[code] = &methods_.back();
+}
+
+bool msgpack_server::check_request(const Json& req) {
+    if (req.is_s()) {
+        msgpack::parser p(req.as_s());
+        unsigned n;
+        long code;
+        return p.try_read_array_header(n) && n >= 2 && p.try_read_int(code);
+    } else
+        return req.is_a() && req.size() >= 2 && req[0].is_i();
+}
+
+tamed void msgpack_server::process(std::shared_ptr<connection> c, Json req) {
+    tvars {
+        unsigned long idx = c->rdseq++;
+        msgpack::parser args(req.is_s() ? req.as_s() : String());
+        unsigned nargs = 0;
+        long code;
+        Json seq, reply;
+        method* m = nullptr;
+        double start, latency;
+    }
+
+    if (req.is_s()) {
+        args.try_read_array_header(nargs);
+        args.try_read_int(code);
+        args >> seq;
+        nargs -= 2;
+        if (!(m = find_method(code)))
+            req = msgpack::parse(req.as_s());
+    } else {
+        code = req[0].as_i();
+        seq = req[1];
+    }
+
+    if (m) {
+        while (m->max_inflight && m->inflight >= m->max_inflight)
+            twait { m->waiting.push_back(make_event()); }
+        ++m->inflight;
+        ++m->ncalls;
+        start = tamer::dnow();
+
+        twait { m->handler(args, nargs, make_event(reply)); }
+
+        latency = tamer::dnow() - start;
+        m->latency_total += latency;
+        m->latency_max = std::max(m->latency_max, latency);
+        ++m->ncompleted;
+        --m->inflight;
+        if (!m->waiting.empty()) {
+            m->waiting.front()();
+            m->waiting.pop_front();
+        }
+    } else if (handler_)
+        twait { handler_(req, make_event(reply)); }
+    else
+        reply = Json::array(0, 0, Json::object("error", "unknown method"));
+
+    if (!reply.is_a())
+        reply = Json::make_array();
+    reply[0] = -code;
+    reply[1] = seq;
+    complete(*c, idx, reply);
+
+    --c->inflight;
+    --ninflight_;
+    c->slot();
+}
+
+void msgpack_server::reject(connection& c, const Json& req) {
+    long code;
+    Json seq;
+    if (req.is_s()) {
+        msgpack::parser p(req.as_s());
+        unsigned n;
+        p.try_read_array_header(n);
+        p.try_read_int(code);
+        p >> seq;
+    } else {
+        code = req[0].as_i();
+        seq = req[1];
+    }
+    Json reply = Json::array(-code, seq, Json::object("error", "overloaded"));
+    ++nrejected_;
+    complete(c, c.rdseq++, reply);
+}
+
+void msgpack_server::complete(connection& c, unsigned long idx, Json& reply) {
+    if (!ordered_) {
+        c.mpfd.write(reply);
+        return;
+    }
+
+    // replies are always arrays, so a null slot is still outstanding
+    size_t pos = idx - c.wrseq;
+    if (pos >= c.outq.size())
+        c.outq.resize(pos + 1);
+    swap(c.outq[pos], reply);
+    while (!c.outq.empty() && c.outq.front()) {
+        c.mpfd.write(c.outq.front());
+        c.outq.pop_front();
+        ++c.wrseq;
+    }
+}
+
+/** @brief Return counters for the server and each registered method.
+
+    A method's "completed" counts calls its handler has finished;
+    "recent" counts those since the previous status() call, and "rate"
+    is recent per second over that interval (0 on the first call). */
+Json msgpack_server::status() const {
+    double now = tamer::dnow();
+    double interval = status_time_ ? now - status_time_ : 0;
+    status_time_ = now;
+    Json j = Json::object("connections", nconnections_,
+                          "inflight", ninflight_,
+                          "max_inflight", max_inflight_,
+                          "max_total_inflight", max_total_inflight_,
+                          "ordered", ordered_,
+                          "requests", nrequests_,
+                          "rejected", nrejected_);
+    if (!methods_.empty()) {
+        Json mj = Json::make_object();
+        for (auto& m : methods_) {
+            double latency_avg = m.ncompleted ? m.latency_total / m.ncompleted : 0;
+            unsigned long recent = m.ncompleted - m.status_completed;
+            m.status_completed = m.ncompleted;
+            mj.set(String(m.code), Json::object("calls", m.ncalls,
+                                                "completed", m.ncompleted,
+                                                "recent", recent,
+                                                "rate", interval > 0 ? recent / interval : 0.0,
+                                                "inflight", m.inflight,
+                                                "waiting", m.waiting.size(),
+                                                "latency_avg", latency_avg,
+                                                "latency_max", m.latency_max));
+        }
+        j.set("methods", mj);
+    }
+    j.set("admission", msgpack_fd::admission_status());
+    j.set("buffer_pool", buffer_pool::global().status());
+    return j;
+}
@@ -0,0 +1,509 @@
+// -*- mode: c++ -*-
+#include "mpshm.hh"
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#if HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+
+namespace {
+enum { nshmfds = 3 };           // ring memory, peer's eventfd, our eventfd
+
+int shm_create_file(size_t size) {
+#if HAVE_MEMFD_CREATE
+    int fd = memfd_create("msgpack_shm", MFD_CLOEXEC);
+#else
+    char name[] = "/dev/shm/msgpack_shm.XXXXXX";
+    int fd = mkstemp(name);
+    if (fd >= 0)
+        unlink(name);
+#endif
+    if (fd >= 0 && ftruncate(fd, size) != 0) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+union shm_cmsg {
+    struct cmsghdr h;
+    char buf[CMSG_SPACE(sizeof(int) * nshmfds)];
+};
+
+bool shm_send_fds(int sock, const int* fds) {
+    char byte = 0;
+    struct iovec iov = {&byte, 1};
+    shm_cmsg cm;
+    struct msghdr msg;
+    memset(&cm, 0, sizeof(cm));
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cm.buf;
+    msg.msg_controllen = sizeof(cm.buf);
+    struct cmsghdr* c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(int) * nshmfds);
+    memcpy(CMSG_DATA(c), fds, sizeof(int) * nshmfds);
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) == 1;
+}
+
+// Returns the number of file descriptors received into fds, or -errno.
+int shm_recv_fds(int sock, int* fds) {
+    char byte;
+    struct iovec iov = {&byte, 1};
+    shm_cmsg cm;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cm.buf;
+    msg.msg_controllen = sizeof(cm.buf);
+    ssize_t amt = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    if (amt < 0)
+        return -errno;
+    int n = 0;
+    for (struct cmsghdr* c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c))
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+            int nc = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (int i = 0; i != nc; ++i) {
+                int fd;
+                memcpy(&fd, CMSG_DATA(c) + i * sizeof(int), sizeof(int));
+                if (n != nshmfds)
+                    fds[n++] = fd;
+                else
+                    close(fd);
+            }
+        }
+    return n;
+}
+}
+
+/** @brief Create rings and pass them to the peer over @a sock.
+
+    @a sock must be a connected Unix stream socket whose other end calls
+    accept(). Each ring holds @a capacity bytes, rounded up to a power of
+    two. Returns false if shared memory or eventfds are unavailable. */
+bool msgpack_shm::create(tamer::fd sock, size_t capacity) {
+    assert(!hdr_);
+#if HAVE_SYS_EVENTFD_H
+    size_t cap = 4096;
+    while (cap < capacity && cap < (size_t(1) << 30))
+        cap <<= 1;
+    size_t maplen = header_size + 2 * cap;
+    int mfd = shm_create_file(maplen);
+    int efd[2] = {eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC),
+                  eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)};
+    void* map = MAP_FAILED;
+    if (mfd >= 0)
+        map = mmap(nullptr, maplen, PROT_READ | PROT_WRITE, MAP_SHARED, mfd, 0);
+
+    bool ok = map != MAP_FAILED && efd[0] >= 0 && efd[1] >= 0;
+    if (ok) {
+        memset(map, 0, header_size);
+        header* h = reinterpret_cast<header*>(map);
+        h->magic = shm_magic;
+        h->capacity = cap;
+        // the peer waits on efd[1] and signals efd[0]
+        int fds[nshmfds] = {mfd, efd[1], efd[0]};
+        ok = shm_send_fds(sock.value(), fds);
+    }
+    if (mfd >= 0)
+        close(mfd);
+    if (!ok) {
+        if (map != MAP_FAILED)
+            munmap(map, maplen);
+        for (int i = 0; i != 2; ++i)
+            if (efd[i] >= 0)
+                close(efd[i]);
+        return false;
+    }
+
+    efd_ = tamer::fd(efd[0]);
+    peer_efd_ = tamer::fd(efd[1]);
+    sock_ = std::move(sock);
+    attach(map, maplen, 0);
+    return true;
+#else
+    (void) sock, (void) capacity;
+    return false;
+#endif
+}
+
+/** @brief Receive rings created by the peer's create() over @a sock. */
+tamed void msgpack_shm::accept(tamer::fd sock, tamer::event<bool> done) {
+    tvars {
+        int fds[nshmfds];
+        int n = -EAGAIN;
+        struct stat st;
+        void* map = MAP_FAILED;
+        header* h;
+    }
+    assert(!hdr_);
+
+#if HAVE_SYS_EVENTFD_H
+    while (sock && (n = shm_recv_fds(sock.value(), fds)) == -EAGAIN)
+        twait { tamer::at_fd_read(sock.value(), make_event()); }
+#endif
+
+    if (n == nshmfds && fstat(fds[0], &st) == 0
+        && st.st_size > (off_t) header_size)
+        map = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   fds[0], 0);
+    h = reinterpret_cast<header*>(map);
+    if (map != MAP_FAILED
+        && (h->magic != shm_magic
+            || (h->capacity & (h->capacity - 1)) != 0
+            || (off_t) (header_size + 2 * (size_t) h->capacity) != st.st_size)) {
+        munmap(map, st.st_size);
+        map = MAP_FAILED;
+    }
+    for (int i = 0; i < n; ++i)
+        if (i == 0 || map == MAP_FAILED)
+            close(fds[i]);
+
+    if (map != MAP_FAILED) {
+        efd_ = tamer::fd(fds[2]);
+        peer_efd_ = tamer::fd(fds[1]);
+        sock_ = std::move(sock);
+        attach(map, st.st_size, 1);
+    }
+    done(map != MAP_FAILED);
+}
+
+void msgpack_shm::attach(void* map, size_t maplen, int side) {
+    static_assert(sizeof(header) <= header_size, "header too large");
+    hdr_ = reinterpret_cast<header*>(map);
+    maplen_ = maplen;
+    capacity_ = hdr_->capacity;
+    char* data = reinterpret_cast<char*>(map) + header_size;
+    tx_ = &hdr_->rings[side];
+    rx_ = &hdr_->rings[!side];
+    txdata_ = data + side * capacity_;
+    rxdata_ = data + !side * capacity_;
+    event_coroutine();
+    peer_coroutine();
+}
+
+void msgpack_shm::destroy() {
+    kill_();
+    peerkill_();
+    wake_();
+    clear_write();
+    clear_read();
+    if (hdr_)
+        munmap(hdr_, maplen_);
+    hdr_ = nullptr;
+    tx_ = rx_ = nullptr;
+    txdata_ = nullptr;
+    rxdata_ = nullptr;
+    efd_.close();
+    peer_efd_.close();
+    sock_.close();
+}
+
+void msgpack_shm::clear() {
+    destroy();
+    efd_ = peer_efd_ = sock_ = tamer::fd();
+    wrbuf_.clear();
+    wrpos_ = 0;
+    wrblocked_ = false;
+    rdparser_.reset();
+    rdreqq_.clear();
+    rdquota_ = rdbatch;
+    rdreply_seq_ = 0;
+}
+
+msgpack_shm::~msgpack_shm() {
+    destroy();
+}
+
+void msgpack_shm::clear_write() {
+    for (auto& e : flushelem_)
+        e.e.trigger((ssize_t) (wrtotal_ - e.wpos) >= 0);
+    flushelem_.clear();
+    for (auto& e : rdreplywait_)
+        if ((ssize_t) (wrtotal_ - e.wpos) < 0)
+            e.e.trigger(Json());
+}
+
+void msgpack_shm::clear_read() {
+    for (auto& e : rdreqwait_)
+        e.unblock();
+    rdreqwait_.clear();
+    for (auto& re : rdreplywait_)
+        re.e.unblock();
+    rdreplywait_.clear();
+}
+
+void msgpack_shm::write(const Json& j, bool iscall) {
+    assert(!iscall || j.is_a());
+    if (!valid())
+        return;
+
+    msgpack::unparser<StringAccum> mu(wrbuf_);
+    if (iscall && j[1].is_null()) { // assign sequence number
+        mu << msgpack::array(std::max(j.size(), 2)) << j[0]
+           << (rdreply_seq_ + rdreplywait_.size());
+        for (int i = 2; i < j.size(); ++i)
+            mu << j[i];
+    } else {
+        if (iscall && rdreplywait_.empty())
+            rdreply_seq_ = j[1].as_u();
+        mu << j;
+    }
+
+    if (!wrblocked_)
+        push();
+}
+
+void msgpack_shm::signal_peer() {
+    uint64_t one = 1;
+    ssize_t r = ::write(peer_efd_.value(), &one, sizeof(one));
+    (void) r;
+    ++nsignals_;
+}
+
+/** Copy pending messages into the transmit ring.
+
+    The ring's tail is published after each copy. If the consumer had
+    already caught up with the old tail, it may be asleep, so it gets a
+    signal. When the ring is full, want_space asks the consumer to
+    signal when it frees space. Both checks pair a sequentially
+    consistent store with a load of the other side's index, so either
+    this end sees the other's progress or the other sees this end's. */
+void msgpack_shm::push() {
+    uint64_t tail = tx_->tail;
+    size_t len = wrbuf_.length();
+    wrblocked_ = false;
+    while (wrpos_ != len) {
+        uint64_t head = __atomic_load_n(&tx_->head, __ATOMIC_ACQUIRE);
+        if (tail - head == capacity_) {
+            __atomic_store_n(&tx_->want_space, 1, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&tx_->head, __ATOMIC_SEQ_CST) == head) {
+                wrblocked_ = true;
+                break;
+            }
+            continue;
+        }
+        size_t off = tail & (capacity_ - 1);
+        size_t n = std::min(len - wrpos_,
+                            std::min(capacity_ - (tail - head), capacity_ - off));
+        memcpy(txdata_ + off, wrbuf_.data() + wrpos_, n);
+        wrpos_ += n;
+        wrtotal_ += n;
+        __atomic_store_n(&tx_->tail, tail + n, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&tx_->head, __ATOMIC_SEQ_CST) == tail)
+            signal_peer();
+        tail += n;
+    }
+    if (wrpos_ == len) {
+        wrbuf_.clear();
+        wrpos_ = 0;
+    }
+    notify_written();
+}
+
+void msgpack_shm::notify_written() {
+    while (!flushelem_.empty()
+           && (ssize_t) (wrtotal_ - flushelem_.front().wpos) >= 0) {
+        flushelem_.front().e.trigger(true);
+        flushelem_.pop_front();
+    }
+    if (pace_recovered())
+        pacer_();
+}
+
+void msgpack_shm::flush(tamer::event<bool> done) {
+    if (wrpos_ == (size_t) wrbuf_.length())
+        done(true);
+    else
+        flushelem_.push_back(flushelem{std::move(done),
+                                       wrtotal_ + wrbuf_.length() - wrpos_});
+}
+
+void msgpack_shm::flush(tamer::event<> done) {
+    flush(tamer::rebind<bool>(done));
+}
+
+void msgpack_shm::read(tamer::event<Json> receiver) {
+    if (!rdreqq_.empty()) {
+        if (receiver)
+            swap(*receiver.result_pointer(), rdreqq_.front());
+        rdreqq_.pop_front();
+        receiver.unblock();
+    } else if (read_until_request(true)) {
+        if (receiver)
+            swap(*receiver.result_pointer(), rdparser_.result());
+        receiver.unblock();
+    } else if (valid())
+        rdreqwait_.push_back(receiver);
+    else
+        receiver(Json());
+}
+
+bool msgpack_shm::read_one_message() {
+    assert(rdquota_ != 0);
+    if (!rx_)
+        return false;
+
+    uint64_t head = rx_->head;
+    while (1) {
+        uint64_t tail = __atomic_load_n(&rx_->tail, __ATOMIC_SEQ_CST);
+        if (head == tail)
+            return false;
+
+        // strings are copied out of the ring, since its space is reused
+        size_t off = head & (capacity_ - 1);
+        size_t n = std::min(size_t(tail - head), capacity_ - off);
+        size_t took = rdparser_.consume(rxdata_ + off, n);
+        head += took;
+        rdtotal_ += took;
+        __atomic_store_n(&rx_->head, head, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&rx_->want_space, __ATOMIC_SEQ_CST)
+            && __atomic_exchange_n(&rx_->want_space, 0, __ATOMIC_SEQ_CST))
+            signal_peer();
+
+        if (rdparser_.done()) {
+            --rdquota_;
+            if (rdquota_ == 0)
+                wake_();        // wake up coroutine [if it's sleeping]
+            return true;
+        }
+    }
+}
+
+bool msgpack_shm::dispatch(bool exit_on_request) {
+    Json& result = rdparser_.result();
+    if (!rdparser_.success())
+        result = Json();        // XXX reset connection
+    rdparser_.reset();
+    if (result.is_a() && result[0].is_i() && result[1].is_i()
+        && result[0].as_i() < 0) {
+        unsigned long seq = result[1].as_i();
+        if (seq >= rdreply_seq_ && seq < rdreply_seq_ + rdreplywait_.size()) {
+            replyelem& done = rdreplywait_[seq - rdreply_seq_];
+            if (done.e.result_pointer())
+                swap(*done.e.result_pointer(), result);
+            done.e.unblock();
+            while (!rdreplywait_.empty() && !rdreplywait_.front().e) {
+                rdreplywait_.pop_front();
+                ++rdreply_seq_;
+            }
+        }
+        return false;
+    }
+
+    if (!rdreqwait_.empty()) {
+        tamer::event<Json>& done = rdreqwait_.front();
+        if (done.result_pointer())
+            swap(*done.result_pointer(), result);
+        done.unblock();
+        rdreqwait_.pop_front();
+        return false;
+    } else if (exit_on_request)
+        return true;
+    else {
+        rdreqq_.push_back(std::move(result));
+        return false;
+    }
+}
+
+tamed void msgpack_shm::event_coroutine() {
+    // NB Like msgpack_fd's coroutines, this may outlive the msgpack_shm;
+    // if `kill` has been triggered, the msgpack_shm is dead.
+
+    tvars {
+        tamer::event<> kill;
+        tamer::rendezvous<> rendez;
+        tamer::event<> e;
+        bool signaled;
+        uint64_t x;
+    }
+
+    kill = kill_ = tamer::make_event(rendez);
+
+    while (kill && valid()) {
+        signaled = false;
+        if (rx_ready() && (!rdreqwait_.empty() || !rdreplywait_.empty()))
+            twait { tamer::at_asap(make_event()); }
+        else {
+            twait {
+                e = make_event();
+                wake_ = e;
+                tamer::at_fd_read(efd_.value(), e);
+            }
+            signaled = true;
+        }
+
+        if (!kill)
+            break;
+        if (signaled && ::read(efd_.value(), &x, sizeof(x)) < 0)
+            x = 0;              // counter already reset
+
+        if (wrblocked_)
+            push();
+        rdquota_ = rdbatch;
+        while (rdquota_ && (!rdreqwait_.empty() || !rdreplywait_.empty())
+               && read_one_message())
+            dispatch(false);
+        if (pace_recovered())
+            pacer_();
+    }
+
+    if (kill) {
+        clear_write();
+        clear_read();
+        kill();                 // avoid leak of active event
+    }
+}
+
+tamed void msgpack_shm::peer_coroutine() {
+    // the socket carries no data after setup; EOF means the peer is gone
+    tvars {
+        tamer::event<> kill;
+        tamer::rendezvous<> rendez;
+        char buf[64];
+        ssize_t amt;
+    }
+
+    kill = peerkill_ = tamer::make_event(rendez);
+
+    while (kill && sock_) {
+        twait { tamer::at_fd_read(sock_.value(), make_event()); }
+        if (!kill)
+            break;
+        amt = ::read(sock_.value(), buf, sizeof(buf));
+        if (amt == 0
+            || (amt < 0 && errno != EAGAIN && errno != EWOULDBLOCK
+                && errno != EINTR)) {
+            sock_.close();
+            wake_();
+        }
+    }
+
+    if (kill)
+        kill();
+}
+
+Json msgpack_shm::status() const {
+    uint64_t txused = 0, rxused = 0;
+    if (tx_) {
+        txused = tx_->tail - __atomic_load_n(&tx_->head, __ATOMIC_ACQUIRE);
+        rxused = __atomic_load_n(&rx_->tail, __ATOMIC_ACQUIRE) - rx_->head;
+    }
+    return Json::object("transport", "shm",
+                        "capacity", capacity_,
+                        "send_total", wrtotal_,
+                        "recv_total", rdtotal_,
+                        "send_buffer", wrbuf_.length() - wrpos_,
+                        "send_ring", txused,
+                        "recv_ring", rxused,
+                        "signals", nsignals_,
+                        "waiters", rdreqwait_.size() + rdreplywait_.size());
+}
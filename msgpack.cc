@@ -5,32 +5,95 @@ namespace {
 const uint8_t nbytes[] = {
     /* 0xC0-0xC3 */ 0, 0, 0, 0,
     /* 0xC4-0xC6 fbin8-fbin32 */ 2, 3, 5,
-    /* 0xC7-0xC9 fext */ 0, 0, 0,
+    /* 0xC7-0xC9 fext8-fext32 */ 3, 4, 6,
     /* 0xCA ffloat32 */ 5,
     /* 0xCB ffloat64 */ 9,
     /* 0xCC-0xD3 ints */ 2, 3, 5, 9, 2, 3, 5, 9,
-    /* 0xD4-0xD8 ffixext */ 0, 0, 0, 0, 0,
+    /* 0xD4-0xD8 ffixext */ 2, 2, 2, 2, 2,
     /* 0xD9-0xDB fstr8-fstr32 */ 2, 3, 5,
     /* 0xDC-0xDD farray16-farray32 */ 3, 5,
     /* 0xDE-0xDF fmap16-fmap32 */ 3, 5
 };
 }
 
+static bool valid_utf8(const uint8_t* first, const uint8_t* last) {
+    while (first != last)
+        if (*first < 0x80)
+            ++first;
+        else {
+            const uint8_t* next = String::skip_utf8_char(first, last);
+            if (next == first)
+                return false;
+            first = next;
+        }
+    return true;
+}
+
+/** Decode packed array data of ext @a type into @a j. */
+static void unpack_array(Json& j, int type, const uint8_t* data, int len,
+                         Json_arena* arena) {
+    int n = len / 8;
+    j = Json::make_array_reserve(n, arena);
+    j.resize(n);
+    Json* a = j.array_data();
+    for (int i = 0; i != n; ++i, data += 8)
+        if (type == format::ext_packed_int64) {
+            int64_t x;
+            format::read_little_endian(&x, data, 1);
+            a[i] = x;
+        } else {
+            double x;
+            format::read_little_endian(&x, data, 1);
+            a[i] = x;
+        }
+}
+
+/** Make room for at least @a need bytes of the pending string, at most
+    doubling the buffer so memory tracks the bytes received. */
+void streaming_parser::grow_string(int need) {
+    int size = stack_.back().size;
+    strcap_ = std::max(need, strcap_ < size / 2 ? 2 * strcap_ : size);
+    StringAccum sa(strcap_);
+    sa.append(str_.data(), strpos_);
+    sa.set_length(strcap_);
+    str_ = sa.take_string();
+}
+
 const uint8_t* streaming_parser::consume(const uint8_t* first,
                                          const uint8_t* last,
                                          const String& str) {
     using std::swap;
     Json* jx;
     int n = 0;
+    int ext = 0;
+    bool bin = false, check;
 
     if (state_ < 0)
         return first;
-    if (state_ == st_partial || state_ == st_string) {
-        int nneed;
-        if (state_ == st_partial)
-            nneed = nbytes[str_.udata()[0] - 0xC0];
+    if (state_ == st_string) {
+        // str_ was allocated at the string's full size
+        int nneed = stack_.back().size - strpos_;
+        if (last - first < nneed)
+            nneed = last - first;
+        if (strpos_ + nneed > strcap_)
+            grow_string(strpos_ + nneed);
+        memcpy(const_cast<char*>(str_.data()) + strpos_, first, nneed);
+        strpos_ += nneed;
+        first += nneed;
+        if (strpos_ != stack_.back().size)
+            return first;
+        stack_.pop_back();
+        jx = stack_.empty() ? &json_ : stack_.back().jp;
+        if (strext_)
+            unpack_array(*jx, strext_, str_.ubegin(), str_.length(), arena_);
+        else if (strutf8_ && !valid_utf8(str_.ubegin(), str_.uend()))
+            goto error;
         else
-            nneed = stack_.back().size;
+            *jx = std::move(str_);
+        str_ = String();
+        goto next;
+    } else if (state_ == st_partial) {
+        int nneed = nbytes[str_.udata()[0] - 0xC0];
         const uint8_t* next;
         if (last - first < nneed - str_.length())
             next = last;
@@ -40,17 +103,10 @@ const uint8_t* streaming_parser::consume(const uint8_t* first,
         if (str_.length() != nneed)
             return next;
         first = next;
-        if (state_ == st_string) {
-            stack_.pop_back();
-            jx = stack_.empty() ? &json_ : stack_.back().jp;
-            *jx = str_;
-            goto next;
-        } else {
-            state_ = st_normal;
-            consume(str_.ubegin(), str_.uend(), str_);
-            if (state_ != st_normal)
-                return next;
-        }
+        state_ = st_normal;
+        consume(str_.ubegin(), str_.uend(), str_);
+        if (state_ != st_normal)
+            return next;
     }
 
     while (first != last) {
@@ -78,27 +134,51 @@ const uint8_t* streaming_parser::consume(const uint8_t* first,
             ++first;
         array:
             if (!jx->is_a())
-                *jx = Json::make_array_reserve(n);
+                *jx = Json::make_array_reserve(n, arena_);
             jx->resize(n);
         } else if (format::is_fixstr(*first)) {
             n = *first - format::ffixstr;
             ++first;
         raw:
+            if (n < 0 || (max_string_ && n > max_string_))
+                goto error;
+            check = check_utf8_ && !ext && !bin;
+            bin = false;
             if (last - first < n) {
-                str_ = String(first, last);
+                // the buffer grows as the string arrives, so a declared
+                // length alone commits little memory; first may point
+                // into str_, so copy before replacing it
+                strcap_ = std::min(n, std::max(int(string_chunk),
+                                               2 * int(last - first)));
+                StringAccum sa(strcap_);
+                sa.append(first, last);
+                sa.set_length(strcap_);
+                str_ = sa.take_string();
+                strpos_ = last - first;
+                strext_ = ext;
+                strutf8_ = check;
                 stack_.push_back(selem{0, n});
                 state_ = st_string;
                 return last;
             }
-            if (first < str.ubegin() || first + n >= str.uend())
-                *jx = String(first, n);
-            else {
-                const char* s = reinterpret_cast<const char*>(first);
-                *jx = str.fast_substring(s, s + n);
+            if (ext) {
+                unpack_array(*jx, ext, first, n, arena_);
+                first += n;
+                ext = n = 0;
+            } else {
+                if (check && !valid_utf8(first, first + n))
+                    goto error;
+                if (first < str.ubegin() || first + n >= str.uend())
+                    *jx = String(first, n);
+                else {
+                    const char* s = reinterpret_cast<const char*>(first);
+                    *jx = str.fast_substring(s, s + n);
+                }
+                first += n;
             }
-            first += n;
         } else {
             uint8_t type = *first - format::fnull;
+            bin = format::is_bin(*first);
             if (!nbytes[type])
                 goto error;
             if (last - first < nbytes[type]) {
@@ -150,6 +230,29 @@ const uint8_t* streaming_parser::consume(const uint8_t* first,
             case format::fstr32 - format::fnull:
                 n = read_in_net_order<uint32_t>(first - 4);
                 goto raw;
+            case format::fext8 - format::fnull:
+                n = first[-2];
+                goto packed;
+            case format::fext16 - format::fnull:
+                n = read_in_net_order<uint16_t>(first - 3);
+                goto packed;
+            case format::fext32 - format::fnull:
+                n = read_in_net_order<uint32_t>(first - 5);
+                goto packed;
+            case format::ffixext1 - format::fnull:
+            case format::ffixext2 - format::fnull:
+            case format::ffixext4 - format::fnull:
+            case format::ffixext8 - format::fnull:
+            case format::ffixext16 - format::fnull:
+                n = 1 << (type - (format::ffixext1 - format::fnull));
+            packed:
+                // only packed arrays are understood
+                ext = int8_t(first[-1]);
+                if ((ext != format::ext_packed_int64
+                     && ext != format::ext_packed_double)
+                    || n % 8 != 0)
+                    goto error;
+                goto raw;
             case format::farray16 - format::fnull:
                 n = read_in_net_order<uint16_t>(first - 2);
                 goto array;
@@ -206,6 +309,146 @@ const uint8_t* streaming_parser::consume(const uint8_t* first,
     return first;
 }
 
+namespace {
+// frame_scanner dispatch: header length, kind, and a kind-specific
+// argument (body length, child count, or width of a length field)
+enum {
+    sk_invalid, sk_scalar, sk_body, sk_items,
+    sk_str, sk_ext, sk_array, sk_map
+};
+struct scan_entry {
+    uint8_t hdr;
+    uint8_t kind;
+    uint8_t arg;
+};
+struct scan_table {
+    scan_entry e[256];
+    scan_table();
+};
+
+scan_table::scan_table() {
+    using namespace format;
+    for (int c = 0; c != 256; ++c) {
+        scan_entry& x = e[c];
+        x = scan_entry{1, sk_scalar, 0};
+        if (is_fixmap(c))
+            x = scan_entry{1, sk_items, uint8_t(2 * (c - ffixmap))};
+        else if (is_fixarray(c))
+            x = scan_entry{1, sk_items, uint8_t(c - ffixarray)};
+        else if (is_fixstr(c))
+            x = scan_entry{1, sk_body, uint8_t(c - ffixstr)};
+    }
+    e[0xC1] = scan_entry{1, sk_invalid, 0};
+    for (int i = 0; i != 3; ++i) {
+        uint8_t w = 1 << i;     // width of the length field
+        e[fbin8 + i] = e[fstr8 + i] = scan_entry{uint8_t(1 + w), sk_str, w};
+        e[fext8 + i] = scan_entry{uint8_t(2 + w), sk_ext, w};
+    }
+    e[ffloat32] = scan_entry{5, sk_scalar, 0};
+    e[ffloat64] = scan_entry{9, sk_scalar, 0};
+    for (int i = 0; i != 4; ++i)
+        e[fuint8 + i] = e[fint8 + i] = scan_entry{uint8_t(1 + (1 << i)),
+                                                  sk_scalar, 0};
+    for (int i = 0; i != 5; ++i)
+        e[ffixext1 + i] = scan_entry{2, sk_body, uint8_t(1 << i)};
+    e[farray16] = scan_entry{3, sk_array, 2};
+    e[farray32] = scan_entry{5, sk_array, 4};
+    e[fmap16] = scan_entry{3, sk_map, 2};
+    e[fmap32] = scan_entry{5, sk_map, 4};
+}
+
+const scan_table scan;
+
+inline uint64_t read_length(const uint8_t* s, unsigned width) {
+    if (width == 1)
+        return s[0];
+    else if (width == 2)
+        return read_in_net_order<uint16_t>(s);
+    else
+        return read_in_net_order<uint32_t>(s);
+}
+}
+
+inline bool frame_scanner::header(const uint8_t* h) {
+    const scan_entry& x = scan.e[h[0]];
+    --need_;
+    switch (x.kind) {
+    case sk_scalar:
+        return true;
+    case sk_body:
+        skip_ = x.arg;
+        return true;
+    case sk_items:
+        need_ += x.arg;
+        return true;
+    case sk_str:
+    case sk_ext:
+        skip_ = read_length(h + 1, x.arg);
+        return true;
+    case sk_array:
+        need_ += read_length(h + 1, x.arg);
+        return true;
+    case sk_map:
+        need_ += 2 * read_length(h + 1, x.arg);
+        return true;
+    default:
+        return false;
+    }
+}
+
+const uint8_t* frame_scanner::consume(const uint8_t* first,
+                                      const uint8_t* last) {
+    const uint8_t* start = first;
+    if (state_ < 0)
+        return first;
+
+    if (hdrlen_) {
+        // finish a header split across inputs
+        unsigned n = std::min(size_t(scan.e[hdr_[0]].hdr - hdrlen_),
+                              size_t(last - first));
+        memcpy(hdr_ + hdrlen_, first, n);
+        hdrlen_ += n;
+        first += n;
+        if (hdrlen_ != scan.e[hdr_[0]].hdr)
+            goto out;
+        hdrlen_ = 0;
+        header(hdr_);
+    }
+
+    while (1) {
+        if (skip_) {
+            size_t n = std::min(skip_, uint64_t(last - first));
+            first += n;
+            skip_ -= n;
+            if (skip_)
+                goto out;
+        }
+        if (need_ == 0) {
+            state_ = st_final;
+            goto out;
+        }
+        if (first == last)
+            goto out;
+
+        const scan_entry& x = scan.e[*first];
+        if (x.hdr > last - first) {
+            memcpy(hdr_, first, last - first);
+            hdrlen_ = last - first;
+            first = last;
+            goto out;
+        }
+        if (!header(first)) {
+            state_ = st_error;
+            goto out;
+        }
+        first += x.hdr;
+    }
+
+ out:
+    length_ += first - start;
+    return first;
+}
+
 parser& parser::operator>>(Str& x) {
     uint32_t len;
     if ((uint32_t) *s_ - format::ffixstr < format::nfixstr) {
@@ -237,4 +480,537 @@ parser& parser::operator>>(String& x) {
     return *this;
 }
 
+bool parser::try_read(double& x) {
+    if (*s_ == format::ffloat64)
+        *this >> x;
+    else if (*s_ == format::ffloat32) {
+        x = read_in_net_order<float>(s_ + 1);
+        s_ += 5;
+    } else if (format::is_fixint(*s_) || (uint32_t) *s_ - format::fuint8 < 8) {
+        long long i;
+        read_int(i);
+        x = i;
+    } else
+        return false;
+    return true;
+}
+
+bool parser::try_read(String& x) {
+    if ((uint32_t) *s_ - format::ffixstr < format::nfixstr
+        || (uint32_t) *s_ - format::fbin8 < 3
+        || (uint32_t) *s_ - format::fstr8 < 3) {
+        *this >> x;
+        return true;
+    } else
+        return false;
+}
+
+template <typename T>
+bool parser::try_read_packed(::std::vector<T>& x, int type) {
+    const uint8_t* s = s_;
+    uint32_t len;
+    if (*s == format::fext8) {
+        len = s[1];
+        s += 3;
+    } else if (*s == format::fext16) {
+        len = read_in_net_order<uint16_t>(s + 1);
+        s += 4;
+    } else if (*s == format::fext32) {
+        len = read_in_net_order<uint32_t>(s + 1);
+        s += 6;
+    } else if ((uint32_t) *s - format::ffixext1 < 5) {
+        len = 1 << (*s - format::ffixext1);
+        s += 2;
+    } else
+        return false;
+    if (int8_t(s[-1]) != type || len % 8 != 0)
+        return false;
+    x.resize(len / 8);
+    format::read_little_endian(x.data(), s, len / 8);
+    s_ = s + len;
+    return true;
+}
+
+/** @brief Read an array of integers, packed or not. */
+bool parser::try_read(::std::vector<int64_t>& x) {
+    unsigned n;
+    if (try_read_packed(x, format::ext_packed_int64))
+        return true;
+    else if (!try_read_array_header(n))
+        return false;
+    x.resize(n);
+    for (unsigned i = 0; i != n; ++i)
+        if (!try_read_int(x[i]))
+            return false;
+    return true;
+}
+
+/** @brief Read an array of numbers, packed or not. */
+bool parser::try_read(::std::vector<double>& x) {
+    unsigned n;
+    if (try_read_packed(x, format::ext_packed_double))
+        return true;
+    else if (!try_read_array_header(n))
+        return false;
+    x.resize(n);
+    for (unsigned i = 0; i != n; ++i)
+        if (!try_read(x[i]))
+            return false;
+    return true;
+}
+
+bool parser::try_read(Json& x) {
+    using std::swap;
+    streaming_parser sp;
+    while (!sp.done())
+        s_ = sp.consume(s_, s_ + 4096, str_);
+    if (sp.success())
+        swap(x, sp.result());
+    return sp.success();
+}
+
+bool event_handler::null() {
+    return true;
+}
+
+bool event_handler::boolean(bool) {
+    return true;
+}
+
+bool event_handler::integer(int64_t) {
+    return true;
+}
+
+/** Called for uint64 values; the default passes them to integer(), which
+    sees values above INT64_MAX as negative. */
+bool event_handler::unsigned_integer(uint64_t x) {
+    return integer(int64_t(x));
+}
+
+bool event_handler::number(double) {
+    return true;
+}
+
+bool event_handler::string(Str, size_t) {
+    return true;
+}
+
+bool event_handler::key(Str data, size_t remaining) {
+    return string(data, remaining);
+}
+
+/** Called for bin values; the default passes them to string(). */
+bool event_handler::binary(Str data, size_t remaining) {
+    return string(data, remaining);
+}
+
+/** Called for ext values, in slices like strings. The default rejects
+    them. */
+bool event_handler::ext(int, Str, size_t) {
+    return false;
+}
+
+bool event_handler::begin_array(uint32_t) {
+    return true;
+}
+
+bool event_handler::end_array() {
+    return true;
+}
+
+bool event_handler::begin_map(uint32_t) {
+    return true;
+}
+
+bool event_handler::end_map() {
+    return true;
+}
+
+/** Report the value whose complete header is at @a h. Strings enter
+    st_string; their bytes follow the header. */
+bool event_parser::header(const uint8_t* h) {
+    const scan_entry& x = scan.e[h[0]];
+    switch (x.kind) {
+    case sk_scalar:
+        if (format::is_fixint(h[0]))
+            return h_.integer(int8_t(h[0])) && finish();
+        switch (h[0]) {
+        case format::fnull:
+            return h_.null() && finish();
+        case format::ffalse:
+        case format::ftrue:
+            return h_.boolean(h[0] - format::ffalse) && finish();
+        case format::ffloat32:
+            return h_.number(read_in_net_order<float>(h + 1)) && finish();
+        case format::ffloat64:
+            return h_.number(read_in_net_order<double>(h + 1)) && finish();
+        case format::fuint8:
+            return h_.integer(h[1]) && finish();
+        case format::fuint16:
+            return h_.integer(read_in_net_order<uint16_t>(h + 1)) && finish();
+        case format::fuint32:
+            return h_.integer(read_in_net_order<uint32_t>(h + 1)) && finish();
+        case format::fuint64:
+            return h_.unsigned_integer(read_in_net_order<uint64_t>(h + 1))
+                && finish();
+        case format::fint8:
+            return h_.integer(int8_t(h[1])) && finish();
+        case format::fint16:
+            return h_.integer(read_in_net_order<int16_t>(h + 1)) && finish();
+        case format::fint32:
+            return h_.integer(read_in_net_order<int32_t>(h + 1)) && finish();
+        case format::fint64:
+            return h_.integer(read_in_net_order<int64_t>(h + 1)) && finish();
+        default:
+            return false;
+        }
+    case sk_body:
+        strleft_ = x.arg;
+        strbin_ = false;
+        strext_ = !format::is_fixstr(h[0]);
+        if (strext_)
+            exttype_ = int8_t(h[1]);
+        break;
+    case sk_str:
+        strleft_ = read_length(h + 1, x.arg);
+        strbin_ = format::is_bin(h[0]);
+        strext_ = false;
+        break;
+    case sk_ext:
+        strleft_ = read_length(h + 1, x.arg);
+        strbin_ = false;
+        strext_ = true;
+        exttype_ = int8_t(h[1 + x.arg]);
+        break;
+    case sk_items:
+        if (format::is_fixmap(h[0]))
+            return push(x.arg / 2, true);
+        else
+            return push(x.arg, false);
+    case sk_array:
+        return push(read_length(h + 1, x.arg), false);
+    case sk_map:
+        return push(read_length(h + 1, x.arg), true);
+    default:
+        return false;
+    }
+    // a string or ext value
+    strkey_ = at_key();
+    state_ = st_string;
+    if (strleft_ == 0) {
+        state_ = st_normal;
+        return deliver(Str()) && finish();
+    }
+    return true;
+}
+
+inline bool event_parser::deliver(Str data) {
+    if (strext_)
+        return h_.ext(exttype_, data, strleft_);
+    else if (strkey_)
+        return h_.key(data, strleft_);
+    else if (strbin_)
+        return h_.binary(data, strleft_);
+    else
+        return h_.string(data, strleft_);
+}
+
+bool event_parser::push(uint64_t n, bool map) {
+    if (stack_.size() == max_depth_)
+        return false;
+    if (!(map ? h_.begin_map(n) : h_.begin_array(n)))
+        return false;
+    stack_.push_back(frame{map ? 2 * n : n, map});
+    if (n == 0) {
+        stack_.back().left = 1;
+        return finish();
+    }
+    return true;
+}
+
+/** Account for a value that just ended, closing the containers it
+    completes. */
+bool event_parser::finish() {
+    while (!stack_.empty()) {
+        if (--stack_.back().left != 0)
+            return true;
+        bool map = stack_.back().map;
+        stack_.pop_back();
+        if (!(map ? h_.end_map() : h_.end_array()))
+            return false;
+    }
+    state_ = st_final;
+    return true;
+}
+
+const uint8_t* event_parser::consume(const uint8_t* first,
+                                     const uint8_t* last) {
+    if (state_ < 0)
+        return first;
+    if (first != last)
+        empty_ = false;
+
+    if (hdrlen_) {
+        // finish a header split across inputs
+        unsigned n = std::min(size_t(scan.e[hdr_[0]].hdr - hdrlen_),
+                              size_t(last - first));
+        memcpy(hdr_ + hdrlen_, first, n);
+        hdrlen_ += n;
+        first += n;
+        if (hdrlen_ != scan.e[hdr_[0]].hdr)
+            return first;
+        hdrlen_ = 0;
+        if (!header(hdr_))
+            goto error;
+    }
+
+    while (state_ >= 0) {
+        if (state_ == st_string) {
+            size_t n = std::min(strleft_, uint64_t(last - first));
+            if (n == 0)
+                return first;
+            strleft_ -= n;
+            Str data(reinterpret_cast<const char*>(first), int(n));
+            first += n;
+            if (!deliver(data))
+                goto error;
+            if (strleft_)
+                return first;
+            state_ = st_normal;
+            if (!finish())
+                goto error;
+            continue;
+        }
+        if (first == last)
+            return first;
+
+        const scan_entry& x = scan.e[*first];
+        if (x.hdr > last - first) {
+            memcpy(hdr_, first, last - first);
+            hdrlen_ = last - first;
+            return last;
+        }
+        first += x.hdr;
+        if (!header(first - x.hdr))
+            goto error;
+    }
+    return first;
+
+ error:
+    state_ = st_error;
+    return first;
+}
+
+namespace {
+inline size_t unsigned_size(uint64_t x) {
+    if (x < format::nfixuint)
+        return 1;
+    else if (x < 256)
+        return 2;
+    else if (x < 65536)
+        return 3;
+    else if (x < 4294967296ULL)
+        return 5;
+    else
+        return 9;
+}
+
+inline size_t signed_size(int64_t x) {
+    if ((uint64_t) x + format::nfixnegint < format::nfixint)
+        return 1;
+    else if ((uint64_t) x + 128 < 256)
+        return 2;
+    else if ((uint64_t) x + 32768 < 65536)
+        return 3;
+    else if ((uint64_t) x + 2147483648ULL < 4294967296ULL)
+        return 5;
+    else
+        return 9;
+}
+
+inline size_t string_size(size_t len) {
+    return len + (len < format::nfixstr ? 1 : len < 256 ? 2
+                  : len < 65536 ? 3 : 5);
+}
+
+inline size_t header_size(uint32_t size) {
+    return size < format::nfixarray ? 1 : size < 65536 ? 3 : 5;
+}
+}
+
+/** @brief Return the number of bytes unparser would write for @a j. */
+size_t encoded_size(const Json& j) {
+    if (j.is_u())
+        return unsigned_size(j.as_u());
+    else if (j.is_i())
+        return signed_size(j.as_i());
+    else if (j.is_d())
+        return 9;
+    else if (j.is_s())
+        return string_size(j.as_s().length());
+    else if (j.is_a()) {
+        size_t n = header_size(j.size());
+        for (auto it = j.cabegin(); it != j.caend(); ++it)
+            n += encoded_size(*it);
+        return n;
+    } else if (j.is_o()) {
+        size_t n = header_size(j.size());
+        for (auto it = j.cobegin(); it != j.coend(); ++it)
+            n += string_size(it.key().length()) + encoded_size(it.value());
+        return n;
+    } else
+        return 1;
+}
+
+/** @brief Write @a j to @a s, which must have encoded_size(@a j) bytes
+    of space. Returns the end of the written data. */
+char* write_unchecked(char* s, const Json& j) {
+    if (j.is_u())
+        return format::write_int(s, j.as_u());
+    else if (j.is_i())
+        return format::write_int(s, j.as_i());
+    else if (j.is_d())
+        return format::write_double(s, j.as_d());
+    else if (j.is_s())
+        return format::write_string(s, j.as_s());
+    else if (j.is_a()) {
+        s = format::write_array_header(s, j.size());
+        for (auto it = j.cabegin(); it != j.caend(); ++it)
+            s = write_unchecked(s, *it);
+        return s;
+    } else if (j.is_o()) {
+        s = format::write_map_header(s, j.size());
+        for (auto it = j.cobegin(); it != j.coend(); ++it) {
+            s = format::write_string(s, it.key());
+            s = write_unchecked(s, it.value());
+        }
+        return s;
+    } else if (j.is_b())
+        return format::write_bool(s, j.as_b());
+    else
+        return format::write_null(s);
+}
+
+static inline bool read_str(const uint8_t* s, Str& x) {
+    if (format::is_fixstr(*s)
+        || (uint32_t) *s - format::fstr8 < 3
+        || (uint32_t) *s - format::fbin8 < 3) {
+        parser(s) >> x;
+        return true;
+    } else
+        return false;
+}
+
+/** @brief Construct a view of the message at the start of @a str.
+
+    The view is invalid if that message is malformed or incomplete. */
+view::view(const String& str)
+    : str_(str), elt_(nullptr), size_(0) {
+    const char* end = scan_frame(str.begin(), str.end());
+    if (end && end != str.begin()) {
+        first_ = reinterpret_cast<const uint8_t*>(str.begin());
+        last_ = reinterpret_cast<const uint8_t*>(end);
+        decode_header();
+    } else
+        first_ = last_ = nullptr;
+}
+
+void view::decode_header() {
+    const uint8_t* s = first_;
+    if (format::is_fixarray(*s) || format::is_fixmap(*s)) {
+        size_ = *s & 0xF;
+        elt_ = s + 1;
+    } else if (*s == format::farray16 || *s == format::fmap16) {
+        size_ = read_in_net_order<uint16_t>(s + 1);
+        elt_ = s + 3;
+    } else if (*s == format::farray32 || *s == format::fmap32) {
+        size_ = read_in_net_order<uint32_t>(s + 1);
+        elt_ = s + 5;
+    }
+}
+
+/** Return the start of element @a i (or key @a i, for maps), remembering
+    the starts of the elements skipped to find it. */
+const uint8_t* view::element(uint32_t i) const {
+    assert(i < size_);
+    if (i == 0)
+        return elt_;
+    if (index_.empty()) {
+        index_.reserve(std::min(size_, uint32_t(i + 8)));
+        index_.push_back(elt_);
+    }
+    while (index_.size() <= i) {
+        const uint8_t* s = skip(index_.back());
+        if (is_o())
+            s = skip(s);
+        index_.push_back(s);
+    }
+    return index_[i];
+}
+
+/** @brief Return a view of array element @a i.
+
+    The result is invalid if this is not an array or @a i is out of
+    range. */
+view view::operator[](size_t i) const {
+    if (!is_a() || i >= size_)
+        return view();
+    const uint8_t* s = element(i);
+    return view(str_, s, skip(s));
+}
+
+/** @brief Return a view of the value of map key @a key.
+
+    The result is invalid if this is not a map or lacks @a key. */
+view view::operator[](Str key) const {
+    if (!is_o())
+        return view();
+    Str k;
+    for (uint32_t i = 0; i != size_; ++i) {
+        const uint8_t* s = element(i);
+        if (read_str(s, k) && k == key) {
+            s = skip(s);
+            return view(str_, s, skip(s));
+        }
+    }
+    return view();
+}
+
+bool view::to_b() const {
+    return json().to_b();
+}
+
+int64_t view::to_i() const {
+    return json().to_i();
+}
+
+double view::to_d() const {
+    return json().to_d();
+}
+
+/** @brief Return the string or binary value, without copying it.
+
+    Returns an empty Str for other values. */
+Str view::as_str() const {
+    Str x;
+    if (first_)
+        read_str(first_, x);
+    return x;
+}
+
+String view::to_s() const {
+    Str x = as_str();
+    if (x.empty())
+        return String();
+    return str_.fast_substring(x.begin(), x.end());
+}
+
+/** @brief Decode the value into Json. */
+Json view::json() const {
+    streaming_parser sp;
+    if (first_)
+        sp.consume(first_, last_, str_);
+    return sp.success() ? sp.result() : Json();
+}
+
 } // namespace msgpack
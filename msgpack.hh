@@ -3,6 +3,8 @@
 #include "json.hh"
 #include "local_vector.hh"
 #include "straccum.hh"
+#include <type_traits>
+#include <utility>
 #include <vector>
 namespace msgpack {
 
@@ -53,6 +55,12 @@ inline bool is_fixarray(uint8_t x) {
 inline bool is_fixmap(uint8_t x) {
     return in_range(x, ffixmap, nfixmap);
 }
+inline bool is_str(uint8_t x) {
+    return is_fixstr(x) || in_range(x, fstr8, 3);
+}
+inline bool is_bin(uint8_t x) {
+    return in_range(x, fbin8, 3);
+}
 
 inline char* write_null(char* s) {
     *s++ = fnull;
@@ -173,6 +181,20 @@ template <typename T>
 inline char* write_string(char* s, const String_base<T>& x) {
     return write_string(s, x.data(), x.length());
 }
+inline char* write_binary(char* s, const char* data, uint32_t len) {
+    if (len < 256) {
+        *s++ = fbin8;
+        *s++ = len;
+    } else if (len < 65536) {
+        *s++ = fbin16;
+        s = write_in_net_order<uint16_t>(s, (uint16_t) len);
+    } else {
+        *s++ = fbin32;
+        s = write_in_net_order<uint32_t>(s, len);
+    }
+    memcpy(s, data, len);
+    return s + len;
+}
 inline char* write_array_header(char* s, uint32_t size) {
     if (size < nfixarray) {
         *s++ = ffixarray + size;
@@ -197,6 +219,64 @@ inline char* write_map_header(char* s, uint32_t size) {
         return write_in_net_order<uint32_t>(s, (uint32_t) size);
     }
 }
+
+// Packed numeric arrays are ext values whose data is the elements in
+// little-endian order, 8 bytes each.
+enum {
+    ext_packed_int64 = 1, ext_packed_double = 2
+};
+inline char* write_ext_header(char* s, int8_t type, uint32_t len) {
+    if (len < 256) {
+        *s++ = fext8;
+        *s++ = len;
+    } else if (len < 65536) {
+        *s++ = fext16;
+        s = write_in_net_order<uint16_t>(s, (uint16_t) len);
+    } else {
+        *s++ = fext32;
+        s = write_in_net_order<uint32_t>(s, len);
+    }
+    *s++ = type;
+    return s;
+}
+template <typename X>
+inline char* write_little_endian(char* s, const X* x, uint32_t n) {
+    static_assert(sizeof(X) == 8, "X must be 8 bytes wide");
+#if WORDS_BIGENDIAN
+    for (uint32_t i = 0; i != n; ++i, s += 8) {
+        uint64_t v;
+        memcpy(&v, &x[i], 8);
+        v = __builtin_bswap64(v);
+        memcpy(s, &v, 8);
+    }
+#else
+    memcpy(s, x, size_t(n) * 8);
+    s += size_t(n) * 8;
+#endif
+    return s;
+}
+inline char* write_packed(char* s, const int64_t* x, uint32_t n) {
+    s = write_ext_header(s, ext_packed_int64, n * 8);
+    return write_little_endian(s, x, n);
+}
+inline char* write_packed(char* s, const double* x, uint32_t n) {
+    s = write_ext_header(s, ext_packed_double, n * 8);
+    return write_little_endian(s, x, n);
+}
+template <typename X>
+inline void read_little_endian(X* x, const uint8_t* s, uint32_t n) {
+    static_assert(sizeof(X) == 8, "X must be 8 bytes wide");
+#if WORDS_BIGENDIAN
+    for (uint32_t i = 0; i != n; ++i, s += 8) {
+        uint64_t v;
+        memcpy(&v, s, 8);
+        v = __builtin_bswap64(v);
+        memcpy(&x[i], &v, 8);
+    }
+#else
+    memcpy(x, s, size_t(n) * 8);
+#endif
+}
 } // namespace format
 
 struct array_t {
@@ -221,6 +301,97 @@ inline object_t object(uint32_t size) {
     return object_t(size);
 }
 
+// binary_t: an opaque byte string, encoded as msgpack bin rather than str.
+// Typed reads accept only bin and share the input buffer.
+struct binary_t {
+    String data;
+    binary_t() {
+    }
+    binary_t(const String& s)
+        : data(s) {
+    }
+};
+
+inline binary_t binary(const String& data) {
+    return binary_t(data);
+}
+
+// packed_t: a numeric array encoded as one ext value rather than a msgpack
+// array. Only this library's parsers read packed arrays, so packing is
+// opt-in: write unparser << packed(v).
+template <typename X>
+struct packed_t {
+    const X* data;
+    size_t size;
+};
+
+inline packed_t<int64_t> packed(const ::std::vector<int64_t>& x) {
+    return packed_t<int64_t>{x.data(), x.size()};
+}
+
+inline packed_t<double> packed(const ::std::vector<double>& x) {
+    return packed_t<double>{x.data(), x.size()};
+}
+
+size_t encoded_size(const Json& j);
+char* write_unchecked(char* s, const Json& j);
+
+// Typed structs.
+//
+// A struct is encoded as a msgpack array of its fields, in order, once it
+// lists them with a member template:
+//
+//     struct log_entry {
+//         long viewno;
+//         long seqno;
+//         String client_uid;
+//         Json request;
+//         template <typename F> void msgpack_fields(F& f) {
+//             f(viewno, seqno, client_uid, request);
+//         }
+//     };
+//
+// unparser<T> << x and parser >> x then read and write the fields
+// directly, with the array size fixed at compile time. Fields may be
+// integers, bool, double, String, Json, std::vector, or other such
+// structs. decode() checks a received message before filling a struct.
+
+template <typename X>
+struct has_fields {
+  private:
+    struct probe {
+        template <typename... A> void operator()(A&...) {}
+    };
+    template <typename Y>
+    static char test(decltype(std::declval<Y&>().msgpack_fields(std::declval<probe&>()))*);
+    template <typename Y>
+    static long test(...);
+  public:
+    static constexpr bool value = sizeof(test<X>(nullptr)) == 1;
+};
+
+template <typename T> class unparser;
+
+template <typename T>
+class field_unparser {
+  public:
+    inline field_unparser(unparser<T>& u)
+        : u_(u) {
+    }
+    template <typename... A> inline void operator()(A&... a) {
+        u_.write_array_header(sizeof...(A));
+        write(a...);
+    }
+  private:
+    unparser<T>& u_;
+    inline void write() {
+    }
+    template <typename A, typename... R> inline void write(A& a, R&... r) {
+        u_ << a;
+        write(r...);
+    }
+};
+
 template <typename T>
 class unparser {
   public:
@@ -307,6 +478,11 @@ class unparser {
         base_.set_end(format::write_string(s, x.data(), x.length()));
         return *this;
     }
+    inline unparser<T>& operator<<(const binary_t& x) {
+        char* s = base_.reserve(5 + x.data.length());
+        base_.set_end(format::write_binary(s, x.data.data(), x.data.length()));
+        return *this;
+    }
     inline unparser<T>& operator<<(array_t x) {
         char* s = base_.reserve(5);
         base_.set_end(format::write_array_header(s, x.size));
@@ -322,6 +498,38 @@ class unparser {
         base_.set_end(format::write_map_header(s, x.size));
         return *this;
     }
+    template <typename B>
+    inline typename std::enable_if<std::is_same<B, bool>::value,
+                                   unparser<T>&>::type operator<<(B x) {
+        base_.append(char(format::ffalse + x));
+        return *this;
+    }
+    template <typename X>
+    inline unparser<T>& write_packed(const X* x, size_t n) {
+        assert(n < (1U << 29));
+        char* s = base_.reserve(6 + n * 8);
+        base_.set_end(format::write_packed(s, x, n));
+        return *this;
+    }
+    template <typename X>
+    inline unparser<T>& operator<<(packed_t<X> x) {
+        return write_packed(x.data, x.size);
+    }
+    template <typename X>
+    inline unparser<T>& operator<<(const ::std::vector<X>& x) {
+        write_array_header(x.size());
+        for (auto& e : x)
+            *this << e;
+        return *this;
+    }
+    template <typename X>
+    inline typename std::enable_if<has_fields<X>::value,
+                                   unparser<T>&>::type operator<<(const X& x) {
+        field_unparser<T> fu(*this);
+        // msgpack_fields is non-const so that parsers can share it
+        const_cast<X&>(x).msgpack_fields(fu);
+        return *this;
+    }
     unparser<T>& operator<<(const Json& j);
     template <typename X>
     inline unparser<T>& write(const X& x) {
@@ -336,6 +544,10 @@ class streaming_parser {
   public:
     inline streaming_parser();
     inline void reset();
+    inline void set_arena(Json_arena* arena);
+    inline void set_check_utf8(bool check);
+    inline void set_max_string(size_t length);
+    inline void recycle(Json& j);
 
     inline bool empty() const;
     inline bool done() const;
@@ -352,11 +564,16 @@ class streaming_parser {
     inline Json& result();
     inline const Json& result() const;
 
+    inline size_t string_remaining() const;
+    inline char* string_buffer();
+    inline void string_filled(size_t n);
+
   private:
     enum {
         st_final = -2, st_error = -1, st_normal = 0, st_partial = 1,
         st_string = 2
     };
+    enum { string_chunk = 1 << 16 };
     struct selem {
         Json* jp;
         int size;
@@ -364,8 +581,135 @@ class streaming_parser {
     int state_;
     local_vector<selem, 2> stack_;
     String str_;
+    int strpos_;                // st_string: bytes of str_ filled so far
+    int strcap_;                // st_string: bytes allocated for str_
+    int max_string_;            // longest string accepted, or 0
+    int strext_;                // st_string: ext type of a packed array
+    bool strutf8_;              // st_string: check the str when complete
+    bool check_utf8_;
     Json json_;
     Json jokey_;
+    Json_arena* arena_;
+
+    void grow_string(int need);
+};
+
+// frame_scanner: finds where a msgpack message ends without decoding it.
+//
+// The scanner keeps only a count of values still owed to the message and
+// the bytes left in the current string, so it never allocates, and skips
+// each string or scalar body with one table lookup. It checks that every
+// type byte is valid but not, for example, that map keys are strings.
+// Like streaming_parser, it accepts input in pieces.
+
+class frame_scanner {
+  public:
+    inline frame_scanner();
+    inline void reset();
+
+    inline bool empty() const;
+    inline bool done() const;
+    inline bool success() const;
+    inline bool error() const;
+    inline size_t length() const;
+
+    inline size_t consume(const char* first, size_t length);
+    inline const char* consume(const char* first, const char* last);
+    const uint8_t* consume(const uint8_t* first, const uint8_t* last);
+
+  private:
+    enum { st_final = -2, st_error = -1, st_normal = 0 };
+    enum { max_header = 9 };
+    int state_;
+    unsigned hdrlen_;           // bytes of a split header in hdr_
+    uint64_t need_;             // values still owed to the message
+    uint64_t skip_;             // body bytes still to skip
+    size_t length_;
+    uint8_t hdr_[max_header];
+
+    inline bool header(const uint8_t* h);
+};
+
+// event_parser: parses a msgpack message into calls on an event_handler.
+//
+// Instead of building a Json, the parser reports each value as it is read:
+// begin_array(n) and begin_map(n) open a container, end_array() and
+// end_map() close it, and scalars and strings arrive in between. String
+// keys arrive through key() and bin values through binary(). Ext values
+// are rejected as errors unless the handler overrides ext() to take them.
+// All of these are delivered in slices as input arrives; each call gets
+// the bytes available and the count still to come, so a long string is
+// never buffered. The parser's memory is therefore bounded by the nesting
+// depth, which is limited to max_depth. A handler method can return false
+// to stop parsing with an error.
+//
+// Like streaming_parser, the parser accepts input in pieces and stops at
+// the end of one message; call reset() to parse the next.
+
+class event_handler {
+  public:
+    virtual ~event_handler() {
+    }
+    virtual bool null();
+    virtual bool boolean(bool x);
+    virtual bool integer(int64_t x);
+    virtual bool unsigned_integer(uint64_t x);
+    virtual bool number(double x);
+    virtual bool string(Str data, size_t remaining);
+    virtual bool key(Str data, size_t remaining);
+    virtual bool binary(Str data, size_t remaining);
+    virtual bool ext(int type, Str data, size_t remaining);
+    virtual bool begin_array(uint32_t n);
+    virtual bool end_array();
+    virtual bool begin_map(uint32_t n);
+    virtual bool end_map();
+};
+
+class event_parser {
+  public:
+    enum { default_max_depth = 1024 };
+
+    inline explicit event_parser(event_handler& h,
+                                 unsigned max_depth = default_max_depth);
+    inline void reset();
+
+    inline bool empty() const;
+    inline bool done() const;
+    inline bool success() const;
+    inline bool error() const;
+    inline size_t depth() const;
+
+    inline size_t consume(const char* first, size_t length);
+    inline const char* consume(const char* first, const char* last);
+    const uint8_t* consume(const uint8_t* first, const uint8_t* last);
+
+  private:
+    enum {
+        st_final = -2, st_error = -1, st_normal = 0, st_string = 1
+    };
+    enum { max_header = 9 };
+    struct frame {
+        uint64_t left;          // values still to read, counting map keys
+        bool map;
+    };
+    event_handler& h_;
+    int state_;
+    unsigned max_depth_;
+    unsigned hdrlen_;           // bytes of a split header in hdr_
+    uint64_t strleft_;          // st_string: bytes of the string to come
+    bool strkey_;
+    bool strbin_;               // st_string: a bin value
+    bool strext_;               // st_string: an ext value, of exttype_
+    int exttype_;
+    bool empty_;
+    uint8_t hdr_[max_header];
+    ::std::vector<frame> stack_;
+
+    inline bool at_key() const;
+    bool header(const uint8_t* h);
+    inline bool deliver(Str data);
+    bool push(uint64_t n, bool map);
+    bool finish();
 };
 
 class parser {
@@ -441,6 +785,10 @@ class parser {
     }
     parser& operator>>(Str& x);
     parser& operator>>(String& x);
+    inline parser& operator>>(binary_t& x) {
+        assert(format::is_bin(*s_));
+        return *this >> x.data;
+    }
     inline parser& read_array_header(unsigned& size) {
         if (format::is_fixarray(*s_)) {
             size = *s_ - format::ffixarray;
@@ -455,8 +803,59 @@ class parser {
         }
         return *this;
     }
+    inline bool try_read_array_header(unsigned& size) {
+        if (format::is_fixarray(*s_) || *s_ == format::farray16
+            || *s_ == format::farray32) {
+            read_array_header(size);
+            return true;
+        } else
+            return false;
+    }
+    template <typename T>
+    inline bool try_read_int(T& x) {
+        if (format::is_fixint(*s_) || (uint32_t) *s_ - format::fuint8 < 8) {
+            read_int(x);
+            return true;
+        } else
+            return false;
+    }
     template <typename T> parser& operator>>(::std::vector<T>& x);
+    inline parser& operator>>(::std::vector<int64_t>& x);
+    inline parser& operator>>(::std::vector<double>& x);
     inline parser& operator>>(Json& j);
+    template <typename X>
+    inline typename std::enable_if<has_fields<X>::value,
+                                   parser&>::type operator>>(X& x);
+
+    // checked reads: return false, possibly after reading part of a
+    // value, if the input does not have the expected type
+    template <typename T>
+    inline typename std::enable_if<std::is_integral<T>::value
+                                   && !std::is_same<T, bool>::value,
+                                   bool>::type try_read(T& x) {
+        return try_read_int(x);
+    }
+    inline bool try_read(bool& x) {
+        if (!format::is_bool(*s_))
+            return false;
+        *this >> x;
+        return true;
+    }
+    bool try_read(double& x);
+    bool try_read(String& x);
+    inline bool try_read(binary_t& x) {
+        if (!format::is_bin(*s_))
+            return false;
+        *this >> x.data;
+        return true;
+    }
+    bool try_read(Json& x);
+    template <typename T> bool try_read(::std::vector<T>& x);
+    bool try_read(::std::vector<int64_t>& x);
+    bool try_read(::std::vector<double>& x);
+    template <typename X>
+    inline typename std::enable_if<has_fields<X>::value,
+                                   bool>::type try_read(X& x);
 
     inline parser& skip_primitives(unsigned n) {
         for (; n != 0; --n) {
@@ -498,6 +897,7 @@ class parser {
     const uint8_t* s_;
     String str_;
     template <typename T> void hard_read_int(T& x);
+    template <typename T> bool try_read_packed(::std::vector<T>& x, int type);
 };
 
 template <typename T>
@@ -540,37 +940,9 @@ void parser::hard_read_int(T& x) {
 
 template <typename T>
 unparser<T>& unparser<T>::operator<<(const Json& j) {
-    if (j.is_null())
-        base_.append(char(format::fnull));
-    else if (j.is_b())
-        base_.append(char(format::ffalse + j.as_b()));
-    else if (j.is_u()) {
-        char* x = base_.reserve(9);
-        base_.set_end(format::write_int(x, j.as_u()));
-    } else if (j.is_i()) {
-        char* x = base_.reserve(9);
-        base_.set_end(format::write_int(x, j.as_i()));
-    } else if (j.is_d()) {
-        char* x = base_.reserve(9);
-        base_.set_end(format::write_double(x, j.as_d()));
-    } else if (j.is_s()) {
-        char* x = base_.reserve(j.as_s().length() + 5);
-        base_.set_end(format::write_string(x, j.as_s()));
-    } else if (j.is_a()) {
-        char* x = base_.reserve(5);
-        base_.set_end(format::write_array_header(x, j.size()));
-        for (auto it = j.cabegin(); it != j.caend(); ++it)
-            *this << *it;
-    } else if (j.is_o()) {
-        char* x = base_.reserve(5);
-        base_.set_end(format::write_map_header(x, j.size()));
-        for (auto it = j.cobegin(); it != j.coend(); ++it) {
-            char* x = base_.reserve(it.key().length() + 5);
-            base_.set_end(format::write_string(x, it.key()));
-            *this << it.value();
-        }
-    } else
-        base_.append(char(format::fnull));
+    // size the whole tree first so the base is checked only once
+    char* x = base_.reserve(encoded_size(j));
+    base_.set_end(write_unchecked(x, j));
     return *this;
 }
 
@@ -606,13 +978,95 @@ parser& parser::operator>>(::std::vector<T>& x) {
     }
     for (; sz != 0; --sz) {
         x.push_back(T());
-        parse(x.back());
+        *this >> x.back();
+    }
+    return *this;
+}
+
+inline parser& parser::operator>>(::std::vector<int64_t>& x) {
+    bool ok = try_read(x);
+    assert(ok);
+    (void) ok;
+    return *this;
+}
+
+inline parser& parser::operator>>(::std::vector<double>& x) {
+    bool ok = try_read(x);
+    assert(ok);
+    (void) ok;
+    return *this;
+}
+
+class field_parser {
+  public:
+    inline field_parser(parser& p, bool checked)
+        : p_(p), checked_(checked), ok_(true) {
+    }
+    inline bool ok() const {
+        return ok_;
+    }
+    template <typename... A> inline void operator()(A&... a) {
+        unsigned n;
+        if (!checked_) {
+            p_.read_array_header(n);
+            assert(n == sizeof...(A));
+            read(a...);
+        } else
+            ok_ = p_.try_read_array_header(n) && n == sizeof...(A)
+                && try_read(a...);
+    }
+  private:
+    parser& p_;
+    bool checked_;
+    bool ok_;
+    inline void read() {
+    }
+    template <typename A, typename... R> inline void read(A& a, R&... r) {
+        p_ >> a;
+        read(r...);
+    }
+    inline bool try_read() {
+        return true;
     }
+    template <typename A, typename... R> inline bool try_read(A& a, R&... r) {
+        return p_.try_read(a) && try_read(r...);
+    }
+};
+
+template <typename X>
+inline typename std::enable_if<has_fields<X>::value,
+                               parser&>::type parser::operator>>(X& x) {
+    field_parser fp(*this, false);
+    x.msgpack_fields(fp);
     return *this;
 }
 
+template <typename T>
+bool parser::try_read(::std::vector<T>& x) {
+    unsigned n;
+    if (!try_read_array_header(n))
+        return false;
+    x.clear();
+    x.reserve(n);
+    for (; n != 0; --n) {
+        x.push_back(T());
+        if (!try_read(x.back()))
+            return false;
+    }
+    return true;
+}
+
+template <typename X>
+inline typename std::enable_if<has_fields<X>::value,
+                               bool>::type parser::try_read(X& x) {
+    field_parser fp(*this, true);
+    x.msgpack_fields(fp);
+    return fp.ok();
+}
+
 inline streaming_parser::streaming_parser()
-    : state_(st_normal) {
+    : state_(st_normal), max_string_(0), check_utf8_(false),
+      arena_(nullptr) {
 }
 
 inline void streaming_parser::reset() {
@@ -620,6 +1074,40 @@ inline void streaming_parser::reset() {
     stack_.clear();
 }
 
+/** @brief Allocate the arrays of parsed values from @a arena.
+
+    A null @a arena allocates them on the heap. The caller decides when to
+    reset @a arena, which must outlive the parser. */
+inline void streaming_parser::set_arena(Json_arena* arena) {
+    arena_ = arena;
+}
+
+/** @brief Reject str values that are not valid UTF-8.
+
+    Bin values are never checked. */
+inline void streaming_parser::set_check_utf8(bool check) {
+    check_utf8_ = check;
+}
+
+/** @brief Reject str, bin and ext values longer than @a length bytes.
+
+    A @a length of 0 accepts any length msgpack can encode. */
+inline void streaming_parser::set_max_string(size_t length) {
+    max_string_ = std::min(length, size_t(INT_MAX));
+}
+
+/** @brief Decode the next message into @a j's storage.
+
+    Where the next message has the same shape as @a j, its arrays and
+    objects are refilled in place rather than reallocated. Always sets
+    @a j to null; if a message is partway decoded, @a j's storage is
+    released instead. */
+inline void streaming_parser::recycle(Json& j) {
+    if (empty())
+        json_ = std::move(j);
+    j = Json();
+}
+
 inline bool streaming_parser::empty() const {
     return state_ == st_normal && stack_.empty();
 }
@@ -658,6 +1146,352 @@ inline const Json& streaming_parser::result() const {
     return json_;
 }
 
+/** @brief Return the number of bytes of a partly read string value
+    that fit in its buffer, or 0 if no string is pending.
+
+    A string split across input buffers is collected in a buffer that
+    grows as its bytes arrive, so the buffer may be smaller than the
+    string. A caller may read up to this many bytes of the string directly
+    into string_buffer(), call string_filled(), and then call consume() to
+    continue parsing. */
+inline size_t streaming_parser::string_remaining() const {
+    return state_ == st_string ? strcap_ - strpos_ : 0;
+}
+
+/** @brief Return where the next string_remaining() bytes belong. */
+inline char* streaming_parser::string_buffer() {
+    assert(state_ == st_string);
+    return const_cast<char*>(str_.data()) + strpos_;
+}
+
+/** @brief Record that @a n bytes were written at string_buffer(). */
+inline void streaming_parser::string_filled(size_t n) {
+    assert(n <= string_remaining());
+    strpos_ += n;
+}
+
+inline frame_scanner::frame_scanner() {
+    reset();
+}
+
+inline void frame_scanner::reset() {
+    state_ = st_normal;
+    hdrlen_ = 0;
+    need_ = 1;
+    skip_ = 0;
+    length_ = 0;
+}
+
+inline bool frame_scanner::empty() const {
+    return length_ == 0;
+}
+
+inline bool frame_scanner::done() const {
+    return state_ < 0;
+}
+
+inline bool frame_scanner::success() const {
+    return state_ == st_final;
+}
+
+inline bool frame_scanner::error() const {
+    return state_ == st_error;
+}
+
+/** @brief Return the number of bytes of the message consumed so far. */
+inline size_t frame_scanner::length() const {
+    return length_;
+}
+
+inline const char* frame_scanner::consume(const char* first,
+                                          const char* last) {
+    return reinterpret_cast<const char*>
+        (consume(reinterpret_cast<const uint8_t*>(first),
+                 reinterpret_cast<const uint8_t*>(last)));
+}
+
+inline size_t frame_scanner::consume(const char* first, size_t length) {
+    const uint8_t* ufirst = reinterpret_cast<const uint8_t*>(first);
+    return consume(ufirst, ufirst + length) - ufirst;
+}
+
+inline event_parser::event_parser(event_handler& h, unsigned max_depth)
+    : h_(h), max_depth_(max_depth) {
+    reset();
+}
+
+inline void event_parser::reset() {
+    state_ = st_normal;
+    hdrlen_ = 0;
+    strleft_ = 0;
+    empty_ = true;
+    stack_.clear();
+}
+
+inline bool event_parser::empty() const {
+    return empty_;
+}
+
+inline bool event_parser::done() const {
+    return state_ < 0;
+}
+
+inline bool event_parser::success() const {
+    return state_ == st_final;
+}
+
+inline bool event_parser::error() const {
+    return state_ == st_error;
+}
+
+/** @brief Return the number of containers currently open. */
+inline size_t event_parser::depth() const {
+    return stack_.size();
+}
+
+inline bool event_parser::at_key() const {
+    return !stack_.empty() && stack_.back().map
+        && stack_.back().left % 2 == 0;
+}
+
+inline const char* event_parser::consume(const char* first,
+                                         const char* last) {
+    return reinterpret_cast<const char*>
+        (consume(reinterpret_cast<const uint8_t*>(first),
+                 reinterpret_cast<const uint8_t*>(last)));
+}
+
+inline size_t event_parser::consume(const char* first, size_t length) {
+    const uint8_t* ufirst = reinterpret_cast<const uint8_t*>(first);
+    return consume(ufirst, ufirst + length) - ufirst;
+}
+
+/** @brief Return the end of the message at [@a first, @a last).
+
+    Returns @a first if the message is incomplete and nullptr if it is
+    malformed. */
+inline const char* scan_frame(const char* first, const char* last) {
+    frame_scanner fs;
+    const char* end = fs.consume(first, last);
+    if (fs.success())
+        return end;
+    else
+        return fs.error() ? nullptr : first;
+}
+
+// view: reads fields of an encoded message in place.
+//
+// A view refers to one value in a String buffer, which it shares. Looking
+// up an element skips over the encoded bytes of those before it, so
+// reading a header field of a large message builds no Json; json()
+// decodes a value only on demand. A view remembers where each element it
+// has skipped starts, so later lookups in the same view skip no element
+// twice, and a key lookup after the first scans only the map's keys. The
+// view of a malformed or incomplete message is invalid, and so is the
+// view of a missing element.
+
+class view {
+  public:
+    class const_iterator;
+    typedef const_iterator iterator;
+
+    inline view();
+    explicit view(const String& str);
+
+    inline bool valid() const;
+    inline explicit operator bool() const;
+    inline bool is_null() const;
+    inline bool is_b() const;
+    inline bool is_i() const;
+    inline bool is_d() const;
+    inline bool is_s() const;
+    inline bool is_str() const;
+    inline bool is_bin() const;
+    inline bool is_a() const;
+    inline bool is_o() const;
+
+    inline size_t size() const;
+    view operator[](size_t i) const;
+    view operator[](Str key) const;
+    inline view operator[](const char* key) const;
+    inline view operator[](int i) const;
+    inline const_iterator begin() const;
+    inline const_iterator end() const;
+
+    bool to_b() const;
+    int64_t to_i() const;
+    double to_d() const;
+    Str as_str() const;
+    String to_s() const;
+    Json json() const;
+
+    inline const char* data() const;
+    inline size_t length() const;
+    inline String encoded() const;
+
+  private:
+    String str_;
+    const uint8_t* first_;
+    const uint8_t* last_;
+    const uint8_t* elt_;        // first element of an array or map
+    uint32_t size_;
+    mutable ::std::vector<const uint8_t*> index_; // element (or key) starts
+
+    inline view(const String& str, const uint8_t* first, const uint8_t* last);
+    void decode_header();
+    inline const uint8_t* skip(const uint8_t* s) const;
+    static inline const uint8_t* skip(const uint8_t* s, const uint8_t* last);
+    const uint8_t* element(uint32_t i) const;
+};
+
+/** @brief Iterates over the elements of an array view, or the keys of a
+    map view; value() returns the value of the current key. The iterator
+    shares the view's buffer, so it remains valid if the view does not. */
+class view::const_iterator {
+  public:
+    inline const_iterator(const view& v, const uint8_t* s, uint32_t i)
+        : str_(v.str_), s_(s), last_(v.last_), i_(i), map_(v.is_o()) {
+    }
+    inline view operator*() const {
+        return view(str_, s_, skip(s_, last_));
+    }
+    inline view key() const {
+        return **this;
+    }
+    inline view value() const {
+        const uint8_t* vs = skip(s_, last_);
+        return view(str_, vs, skip(vs, last_));
+    }
+    inline const_iterator& operator++() {
+        s_ = skip(s_, last_);
+        if (map_)
+            s_ = skip(s_, last_);
+        ++i_;
+        return *this;
+    }
+    inline bool operator==(const const_iterator& x) const {
+        return i_ == x.i_;
+    }
+    inline bool operator!=(const const_iterator& x) const {
+        return i_ != x.i_;
+    }
+  private:
+    String str_;
+    const uint8_t* s_;
+    const uint8_t* last_;
+    uint32_t i_;
+    bool map_;
+};
+
+inline view::view()
+    : first_(nullptr), last_(nullptr), elt_(nullptr), size_(0) {
+}
+
+inline view::view(const String& str, const uint8_t* first,
+                  const uint8_t* last)
+    : str_(str), first_(first), last_(last), elt_(nullptr), size_(0) {
+    decode_header();
+}
+
+inline bool view::valid() const {
+    return first_;
+}
+
+inline view::operator bool() const {
+    return first_;
+}
+
+inline bool view::is_null() const {
+    return first_ && *first_ == format::fnull;
+}
+
+inline bool view::is_b() const {
+    return first_ && (*first_ == format::ffalse || *first_ == format::ftrue);
+}
+
+inline bool view::is_i() const {
+    return first_ && (format::is_fixint(*first_)
+                      || (uint32_t) *first_ - format::fuint8 < 8);
+}
+
+inline bool view::is_d() const {
+    return first_ && (*first_ == format::ffloat32
+                      || *first_ == format::ffloat64);
+}
+
+inline bool view::is_s() const {
+    return first_ && (format::is_fixstr(*first_)
+                      || (uint32_t) *first_ - format::fstr8 < 3
+                      || (uint32_t) *first_ - format::fbin8 < 3);
+}
+
+/** @brief Return true if the value is a str, as opposed to a bin. */
+inline bool view::is_str() const {
+    return first_ && format::is_str(*first_);
+}
+
+inline bool view::is_bin() const {
+    return first_ && format::is_bin(*first_);
+}
+
+inline bool view::is_a() const {
+    return first_ && (format::is_fixarray(*first_)
+                      || *first_ == format::farray16
+                      || *first_ == format::farray32);
+}
+
+inline bool view::is_o() const {
+    return first_ && (format::is_fixmap(*first_)
+                      || *first_ == format::fmap16
+                      || *first_ == format::fmap32);
+}
+
+/** @brief Return the number of elements of an array or entries of a map.
+
+    Returns 0 for other values. */
+inline size_t view::size() const {
+    return size_;
+}
+
+inline view view::operator[](const char* key) const {
+    return (*this)[Str(key)];
+}
+
+inline view view::operator[](int i) const {
+    return i >= 0 ? (*this)[size_t(i)] : view();
+}
+
+inline view::const_iterator view::begin() const {
+    return const_iterator(*this, elt_, 0);
+}
+
+inline view::const_iterator view::end() const {
+    return const_iterator(*this, nullptr, size_);
+}
+
+/** @brief Return the encoded bytes of the value. */
+inline const char* view::data() const {
+    return reinterpret_cast<const char*>(first_);
+}
+
+inline size_t view::length() const {
+    return last_ - first_;
+}
+
+inline String view::encoded() const {
+    return str_.fast_substring(data(), data() + length());
+}
+
+inline const uint8_t* view::skip(const uint8_t* s, const uint8_t* last) {
+    return reinterpret_cast<const uint8_t*>
+        (scan_frame(reinterpret_cast<const char*>(s),
+                    reinterpret_cast<const char*>(last)));
+}
+
+inline const uint8_t* view::skip(const uint8_t* s) const {
+    return skip(s, last_);
+}
+
 inline parser& parser::operator>>(Json& j)  {
     using std::swap;
     streaming_parser sp;
@@ -684,5 +1518,27 @@ inline Json parse(const String& str) {
     return Json();
 }
 
+/** @brief Encode the typed struct @a x. */
+template <typename X>
+inline typename std::enable_if<has_fields<X>::value, String>::type
+unparse(const X& x) {
+    StringAccum sa;
+    unparser<StringAccum>(sa, x);
+    return sa.take_string();
+}
+
+/** @brief Decode the message @a str into the typed struct @a x.
+
+    Returns false if @a str is not exactly one well-formed message whose
+    fields have the types of @a x's. @a x may then be partly filled. */
+template <typename X>
+bool decode(const String& str, X& x) {
+    const char* end = scan_frame(str.begin(), str.end());
+    if (end != str.end() || str.empty())
+        return false;
+    parser p(str);
+    return p.try_read(x) && p.position() == end;
+}
+
 } // namespace msgpack
 #endif
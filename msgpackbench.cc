@@ -0,0 +1,251 @@
+// -*- c-basic-offset: 4 -*-
+#include "msgpack.hh"
+#include <chrono>
+#include <new>
+#include <stdlib.h>
+#include <string.h>
+
+// msgpackbench: throughput of the msgpack and Json codecs.
+//
+// Each benchmark encodes or decodes one corpus of messages over and over
+// for at least `-t SECONDS` (default 0.5), then reports MB/s of encoded
+// data, ns per message, and heap allocations per message. Results are a
+// JSON array, one benchmark per line. Name corpora or codecs on the
+// command line to run only those.
+
+static unsigned long nallocs;
+
+void* operator new(size_t size) {
+    ++nallocs;
+    if (void* p = malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+void operator delete[](void* p) noexcept {
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+
+void operator delete[](void* p, size_t) noexcept {
+    free(p);
+}
+
+struct corpus {
+    const char* name;
+    std::vector<Json> json;
+    std::vector<String> msgpack;
+    std::vector<String> text;
+    size_t msgpack_bytes;
+    size_t text_bytes;
+
+    corpus(const char* name)
+        : name(name), msgpack_bytes(0), text_bytes(0) {
+    }
+    void add(Json j) {
+        msgpack.push_back(msgpack::unparse(j));
+        msgpack_bytes += msgpack.back().length();
+        text.push_back(j.unparse());
+        text_bytes += text.back().length();
+        json.push_back(std::move(j));
+    }
+};
+
+static String random_string(int len) {
+    StringAccum sa;
+    for (int i = 0; i != len; ++i)
+        sa << char('a' + random() % 26);
+    return sa.take_string();
+}
+
+static std::vector<corpus> make_corpora() {
+    std::vector<corpus> cs;
+    srandom(1);
+
+    // mprpc calls and their replies
+    cs.emplace_back("rpc");
+    for (int i = 0; i != 1000; ++i)
+        if (i % 2 == 0)
+            cs.back().add(Json::array(1, i, "get",
+                                      Json::object("key", "k" + String(random() % 100000))));
+        else
+            cs.back().add(Json::array(-1, i - 1, 0,
+                                      Json::object("value", random_string(24),
+                                                   "version", random() % 1000)));
+
+    // Vrreplica commit messages carrying 32 log entries each
+    cs.emplace_back("commit");
+    for (int i = 0; i != 100; ++i) {
+        Json msg = Json::array("commit", Json::null, 3, 32 * (i + 1), 4, 32 * i);
+        for (int j = 0; j != 32; ++j)
+            msg.push_back_list(random_string(8), 32 * i + j,
+                               Json::array("put", "k" + String(random() % 100000),
+                                           random_string(40)));
+        cs.back().add(std::move(msg));
+    }
+
+    // large string payloads
+    cs.emplace_back("strings");
+    for (int i = 0; i != 20; ++i)
+        cs.back().add(Json::array(1, i, "put", random_string(65536)));
+
+    // deeply nested arrays and objects
+    cs.emplace_back("nested");
+    for (int i = 0; i != 100; ++i) {
+        Json j = Json::array(i, "leaf");
+        for (int d = 0; d != 64; ++d)
+            j = d % 2 ? Json::array(d, std::move(j)) : Json::object("x", std::move(j));
+        cs.back().add(std::move(j));
+    }
+
+    return cs;
+}
+
+struct benchmark {
+    const char* name;
+    bool msgpack;               // corpus bytes are msgpack, not JSON text
+    // process every message in the corpus once; return a checksum
+    size_t (*pass)(const corpus& c);
+};
+
+static size_t msgpack_unparser_pass(const corpus& c) {
+    StringAccum sa;
+    size_t n = 0;
+    for (auto& j : c.json) {
+        sa.clear();
+        msgpack::unparser<StringAccum> u(sa);
+        u << j;
+        n += sa.length();
+    }
+    return n;
+}
+
+static size_t msgpack_streaming_parser_pass(const corpus& c) {
+    size_t n = 0;
+    for (auto& s : c.msgpack) {
+        msgpack::streaming_parser sp;
+        sp.consume(s.begin(), s.end(), s);
+        n += sp.success() && sp.result().size();
+    }
+    return n;
+}
+
+static size_t msgpack_recycle_pass(const corpus& c) {
+    msgpack::streaming_parser sp;
+    Json j;
+    size_t n = 0;
+    for (auto& s : c.msgpack) {
+        sp.reset();
+        sp.recycle(j);
+        sp.consume(s.begin(), s.end(), s);
+        n += sp.success() && sp.result().size();
+        j = std::move(sp.result());
+    }
+    return n;
+}
+
+static size_t msgpack_parser_pass(const corpus& c) {
+    Json j;
+    size_t n = 0;
+    for (auto& s : c.msgpack) {
+        msgpack::parser p(s);
+        p >> j;
+        n += j.size();
+    }
+    return n;
+}
+
+static size_t json_unparse_pass(const corpus& c) {
+    size_t n = 0;
+    for (auto& j : c.json)
+        n += j.unparse().length();
+    return n;
+}
+
+static size_t json_parse_pass(const corpus& c) {
+    size_t n = 0;
+    for (auto& s : c.text)
+        n += Json::parse(s).size();
+    return n;
+}
+
+static const benchmark benchmarks[] = {
+    {"msgpack_unparser", true, msgpack_unparser_pass},
+    {"msgpack_streaming_parser", true, msgpack_streaming_parser_pass},
+    {"msgpack_streaming_parser_recycle", true, msgpack_recycle_pass},
+    {"msgpack_parser", true, msgpack_parser_pass},
+    {"json_unparse", false, json_unparse_pass},
+    {"json_parse", false, json_parse_pass}
+};
+
+static Json run(const benchmark& b, const corpus& c, double min_time) {
+    typedef std::chrono::steady_clock clock;
+    volatile size_t sink = b.pass(c); // warm up
+    unsigned long passes = 0, allocs = nallocs;
+    clock::time_point t0 = clock::now();
+    double elapsed;
+    do {
+        sink = sink + b.pass(c);
+        ++passes;
+        elapsed = std::chrono::duration<double>(clock::now() - t0).count();
+    } while (elapsed < min_time);
+    allocs = nallocs - allocs;
+
+    double nmsgs = double(passes) * c.json.size();
+    double nbytes = double(passes) * (b.msgpack ? c.msgpack_bytes : c.text_bytes);
+    return Json::object("corpus", c.name,
+                        "codec", b.name,
+                        "messages", c.json.size(),
+                        "bytes", b.msgpack ? c.msgpack_bytes : c.text_bytes,
+                        "passes", passes,
+                        "mb_per_s", nbytes / elapsed / 1e6,
+                        "ns_per_message", elapsed * 1e9 / nmsgs,
+                        "allocs_per_message", allocs / nmsgs);
+}
+
+static bool named(int argc, char** argv, const char* name) {
+    for (int i = 1; i < argc; ++i)
+        if (strcmp(argv[i], name) == 0)
+            return true;
+    return false;
+}
+
+int main(int argc, char** argv) {
+    double min_time = 0.5;
+    for (int i = 1; i < argc; ++i)
+        if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            min_time = strtod(argv[i + 1], nullptr);
+            ++i;
+        } else if (argv[i][0] == '-' && argv[i][1]) {
+            std::cerr << "Usage: msgpackbench [-t SECONDS] [CORPUS|CODEC...]\n";
+            exit(1);
+        }
+
+    std::vector<corpus> cs = make_corpora();
+    bool any_corpus = false, any_codec = false;
+    for (auto& c : cs)
+        any_corpus = any_corpus || named(argc, argv, c.name);
+    for (auto& b : benchmarks)
+        any_codec = any_codec || named(argc, argv, b.name);
+
+    const char* sep = "[";
+    for (auto& c : cs)
+        for (auto& b : benchmarks)
+            if ((!any_corpus || named(argc, argv, c.name))
+                && (!any_codec || named(argc, argv, b.name))) {
+                std::cout << sep << run(b, c, min_time).unparse() << std::flush;
+                sep = ",\n ";
+            }
+    std::cout << (*sep == '[' ? "[]\n" : "]\n");
+}
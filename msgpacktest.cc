@@ -1,4 +1,5 @@
 #include "msgpack.hh"
+#include "mpcompress.hh"
 
 enum { status_ok, status_error, status_incomplete };
 
@@ -53,10 +54,109 @@ static void test(const char* file, int line,
         }
         onetest(file, line, data, len, "by 1s", take, -1, unparse, status, a);
     }
+
+    // the frame scanner must find the same message boundary
+    if (status == status_ok) {
+        msgpack::frame_scanner fs;
+        take = fs.consume(data, data + len);
+        if (take != data + expected_take || !fs.success()
+            || fs.length() != size_t(expected_take))
+            test_error(file, line, data, len, "scan", "scan took " + String(take - data) + " chars");
+        fs.reset();
+        for (take = data; take != data + len; ++take)
+            if (fs.consume(take, take + 1) != take + (take < data + expected_take))
+                test_error(file, line, data, len, "scan by 1s", "scan took unusual amount after " + String(take - data));
+        if (!fs.success())
+            test_error(file, line, data, len, "scan by 1s", "scan not done");
+    }
 }
 
 #define TEST(...) test(__FILE__, __LINE__, ## __VA_ARGS__)
 
+// records parse events as text
+struct test_event_log : public msgpack::event_handler {
+    StringAccum sa;
+    bool null() {
+        sa << "n ";
+        return true;
+    }
+    bool boolean(bool x) {
+        sa << (x ? "t " : "f ");
+        return true;
+    }
+    bool integer(int64_t x) {
+        sa << x << ' ';
+        return true;
+    }
+    bool number(double x) {
+        sa << x << "d ";
+        return true;
+    }
+    bool string(Str data, size_t remaining) {
+        sa << data;
+        if (!remaining)
+            sa << "$ ";
+        return true;
+    }
+    bool key(Str data, size_t remaining) {
+        sa << data;
+        if (!remaining)
+            sa << ": ";
+        return true;
+    }
+    bool begin_array(uint32_t n) {
+        sa << '[' << n << ' ';
+        return true;
+    }
+    bool end_array() {
+        sa << "] ";
+        return true;
+    }
+    bool begin_map(uint32_t n) {
+        sa << '{' << n << ' ';
+        return true;
+    }
+    bool end_map() {
+        sa << "} ";
+        return true;
+    }
+};
+
+struct test_vectors {
+    std::vector<int64_t> lognos;
+    std::vector<double> weights;
+    template <typename F> void msgpack_fields(F& f) {
+        f(lognos, weights);
+    }
+};
+
+struct test_blob {
+    String name;
+    msgpack::binary_t data;
+    template <typename F> void msgpack_fields(F& f) {
+        f(name, data);
+    }
+};
+
+struct test_point {
+    int x;
+    double y;
+    template <typename F> void msgpack_fields(F& f) {
+        f(x, y);
+    }
+};
+
+struct test_entry {
+    long seqno;
+    bool committed;
+    String client;
+    std::vector<test_point> points;
+    Json request;
+    template <typename F> void msgpack_fields(F& f) {
+        f(seqno, committed, client, points, request);
+    }
+};
+
 void check_correctness() {
     TEST("\0", 1, 1, "0");
     TEST("\xFF  ", 3, 1, "-1");
@@ -124,6 +224,304 @@ void check_correctness() {
              "[9223372036854775808,-9223372036854775808]");
     }
 
+    {
+        String s = msgpack::unparse(Json::array(-300, 2, "x"));
+        msgpack::parser p(s);
+        unsigned n = 0;
+        long code = 0, seq = 0;
+        assert(p.try_read_array_header(n) && n == 3);
+        assert(p.try_read_int(code) && code == -300);
+        assert(p.try_read_int(seq) && seq == 2);
+        assert(!p.try_read_int(seq) && !p.try_read_array_header(n));
+    }
+
+    {
+        // a large string split across buffers, finished by direct fill
+        String big = String::make_fill('x', 100000);
+        String s = msgpack::unparse(Json::array(big, 1));
+        msgpack::streaming_parser a;
+        size_t take = a.consume(s.data(), 1000);
+        assert(take == 1000 && a.string_remaining() == 65536 - 994);
+        memcpy(a.string_buffer(), s.data() + take, 50000);
+        a.string_filled(50000);
+        take += 50000;
+        take += a.consume(s.data() + take, s.length() - take);
+        assert((int) take == s.length() && a.success());
+        assert(a.result()[0].as_s() == big && a.result()[1] == 1);
+        assert(a.string_remaining() == 0);
+
+        // a declared length alone does not commit memory
+        a.reset();
+        a.consume("\xdb\x7f\xff\xff\xff" "abc", 8);
+        assert(!a.done() && a.string_remaining() == 65536 - 3);
+        a.reset();
+        a.set_max_string(99999);
+        a.consume(s.data(), s.length());
+        assert(a.error());
+    }
+
+    {
+        // scan_frame finds boundaries without decoding
+        String s = msgpack::unparse(Json::array(-1, 7, String::make_fill('x', 70000),
+                                                Json::object("a", 1.5)));
+        const char* end = s.end();
+        assert(msgpack::scan_frame(s.begin(), end) == end);
+        assert(msgpack::scan_frame(s.begin(), end - 1) == s.begin());
+        assert(msgpack::scan_frame(s.begin(), s.begin() + 3) == s.begin());
+        const char bad[] = "\x92\xC1\x00";
+        assert(msgpack::scan_frame(bad, bad + 3) == nullptr);
+        // ext types are skipped whole
+        const char ext[] = "\x92\xD6\x01" "abcd" "\xC7\x03\x02" "xyz";
+        assert(msgpack::scan_frame(ext, ext + 13) == ext + 13);
+        // a map owes two values per entry
+        msgpack::frame_scanner fs;
+        assert(fs.consume("\x81\xA1" "a", 2) == 2 && !fs.done());
+        assert(fs.consume("a\x01\x02", 3) == 2 && fs.success() && fs.length() == 4);
+    }
+
+    {
+        // typed structs encode as arrays of their fields
+        test_entry e{-3, true, "c1", {{1, 0.5}, {-2, 2}}, Json::object("op", "put")};
+        String s = msgpack::unparse(e);
+        assert(msgpack::parse(s).unparse()
+               == "[-3,true,\"c1\",[[1,0.5],[-2,2]],{\"op\":\"put\"}]");
+        test_entry f;
+        assert(msgpack::decode(s, f));
+        assert(f.seqno == -3 && f.committed && f.client == "c1"
+               && f.points.size() == 2 && f.points[1].x == -2
+               && f.points[1].y == 2 && f.request["op"] == "put");
+        msgpack::parser p(s);
+        test_entry g;
+        p >> g;
+        assert(p.position() == s.end() && g.points[0].y == 0.5);
+        // wrong arity, wrong types, and trailing or missing bytes fail
+        test_point pt;
+        assert(!msgpack::decode(msgpack::unparse(Json::array(1, 2, 3)), pt));
+        assert(!msgpack::decode(msgpack::unparse(Json::array("1", 2)), pt));
+        assert(msgpack::decode(msgpack::unparse(Json::array(1, 2)), pt));
+        assert(!msgpack::decode(s + "\x01", f));
+        assert(!msgpack::decode(s.substring(0, s.length() - 1), f));
+    }
+
+    {
+        // views read fields in place
+        Json j = Json::array(1, -2, Json::object("k", "v", "n", Json::array(3.5, true)),
+                             String::make_fill('x', 300), Json::null);
+        String s = msgpack::unparse(j);
+        msgpack::view v(s);
+        assert(v.valid() && v.is_a() && v.size() == 5);
+        assert(v[1].is_i() && v[1].to_i() == -2);
+        assert(v[3].is_s() && v[3].as_str().length() == 300);
+        assert(v[3].to_s().data() >= s.begin() && v[3].to_s().data() < s.end());
+        assert(v[0].to_i() == 1 && v[4].is_null() && !v[5].valid());
+        assert(v[2].is_o() && v[2]["k"].to_s() == "v" && !v[2]["z"]);
+        assert(v[2]["n"][0].to_d() == 3.5 && v[2]["n"][1].to_b());
+        assert(v[2]["n"].json().unparse() == "[3.5,true]");
+        assert(v[2].encoded() == msgpack::unparse(j[2]));
+        assert(v.json().unparse() == j.unparse());
+        int n = 0;
+        for (auto it = v[2].begin(); it != v[2].end(); ++it, ++n)
+            assert(it.key().to_s() == (n ? "n" : "k"));
+        assert(n == 2);
+        n = 0;
+        for (auto x : v)
+            n += x.is_i();
+        assert(n == 2);
+        assert(!msgpack::view(s.substring(0, s.length() - 1)).valid());
+        assert(!msgpack::view(String()).valid() && !v[0][0].valid());
+    }
+
+    {
+        // event_parser reports values without building Json
+        String s = msgpack::unparse(Json::array(Json::object("ab", -300, "c", Json::array()),
+                                                String::make_fill('x', 40), 2.5,
+                                                true, Json::null, Json::make_object()));
+        test_event_log log;
+        msgpack::event_parser ep(log);
+        assert(ep.consume(s.data(), s.length()) == size_t(s.length()));
+        assert(ep.success() && ep.depth() == 0);
+        String expected = "[6 {2 ab: -300 c: [0 ] } " + String::make_fill('x', 40)
+            + "$ 2.5d t n {0 } ] ";
+        assert(log.sa.take_string() == expected);
+        ep.reset();
+        for (int i = 0; i != s.length(); ++i)
+            assert(ep.consume(s.data() + i, 1) == 1 && ep.done() == (i == s.length() - 1));
+        assert(ep.success() && log.sa.take_string() == expected);
+        // depth is limited; bad bytes are errors
+        msgpack::event_parser shallow(log, 1);
+        shallow.consume(s.data(), s.length());
+        assert(shallow.error());
+        const char bad[] = "\x92\xC1\x00";
+        ep.reset();
+        ep.consume(bad, 3);
+        assert(ep.error());
+    }
+
+    {
+        // arena-allocated arrays outlive reset() and copy on write
+        Json_arena arena;
+        msgpack::streaming_parser sp;
+        sp.set_arena(&arena);
+        String s = msgpack::unparse(Json::array(1, Json::array(2, 3), "x"));
+        sp.consume(s.begin(), s.end(), s);
+        Json a = std::move(sp.result());
+        assert(a.unparse() == "[1,[2,3],\"x\"]" && arena.nblocks() == 1);
+        Json b = a;
+        arena.reset();
+        assert(arena.nblocks() == 0);
+        b[1].push_back(4);
+        b[0] = 0;
+        assert(a.unparse() == "[1,[2,3],\"x\"]" && b.unparse() == "[0,[2,3,4],\"x\"]");
+        a = b = Json();
+        for (int i = 0; i != 4000; ++i) {
+            sp.reset();
+            sp.consume(s.begin(), s.end(), s);
+            assert(sp.success());
+            sp.result() = Json();
+        }
+        assert(arena.nblocks() > 1);
+        arena.reset();
+        assert(arena.nblocks() > 1);
+    }
+
+    {
+        // a recycled message's storage is refilled in place
+        msgpack::streaming_parser sp;
+        String s = msgpack::unparse(Json::array(1, Json::object("a", 2), Json::array(3, 4)));
+        sp.consume(s.begin(), s.end(), s);
+        Json a = std::move(sp.result());
+        const Json* data = a.array_data();
+        const Json* nested = data[2].array_data();
+        sp.reset();
+        sp.recycle(a);
+        assert(a.is_null());
+        s = msgpack::unparse(Json::array(5, Json::object("b", 6), Json::array(7)));
+        sp.consume(s.begin(), s.end(), s);
+        assert(sp.success());
+        a = std::move(sp.result());
+        assert(a.unparse() == "[5,{\"b\":6},[7]]");
+        assert(a.array_data() == data && data[2].array_data() == nested);
+
+        // mid-message, the recycled Json is dropped and the parse goes on
+        sp.reset();
+        sp.consume(s.begin(), 3, s);
+        assert(!sp.empty() && !sp.done());
+        sp.recycle(a);
+        assert(a.is_null());
+        sp.consume(s.begin() + 3, s.length() - 3, s);
+        assert(sp.success() && sp.result().unparse() == "[5,{\"b\":6},[7]]");
+    }
+
+    {
+        // encoded_size is exact at every size boundary
+        Json j = Json::array(0, 127, 128, 255, 256, 65535, 65536, -32, -33, -128,
+                             -129, -32768, -32769, 4294967295U, 4294967296ULL,
+                             (int64_t) -2147483648LL, (int64_t) -2147483649LL,
+                             1.5, true, Json::null, String::make_fill('s', 31),
+                             String::make_fill('s', 32), String::make_fill('s', 256),
+                             Json::object("k", Json::make_array()));
+        for (int n : {15, 16, 65536}) {
+            Json a = Json::make_array();
+            a.resize(n);
+            j.push_back(a);
+        }
+        for (auto it = j.cabegin(); it != j.caend(); ++it)
+            assert(msgpack::encoded_size(*it) == size_t(msgpack::unparse(*it).length()));
+        String s = msgpack::unparse(j);
+        assert(msgpack::encoded_size(j) == size_t(s.length()));
+        assert(msgpack::parse(s).unparse() == j.unparse());
+    }
+
+    {
+        // numeric vectors are arrays unless packed into ext values
+        test_vectors tv{{1, -2, 1LL << 40}, {0.5}};
+        assert(msgpack::unparse(tv) == msgpack::unparse(Json::array(Json::array(1, -2, 1LL << 40), Json::array(0.5))));
+        StringAccum sa;
+        msgpack::unparser<StringAccum> u(sa);
+        u << msgpack::array(2) << msgpack::packed(tv.lognos)
+          << msgpack::packed(tv.weights);
+        String s = sa.take_string();
+        assert(s.length() == 1 + 3 + 24 + 3 + 8);
+        assert(memcmp(s.data() + 1, "\xC7\x18\x01\x01\0\0\0\0\0\0\0", 11) == 0);
+        assert(msgpack::parse(s).unparse() == "[[1,-2,1099511627776],[0.5]]");
+        test_vectors tw;
+        assert(msgpack::decode(s, tw) && tw.lognos == tv.lognos
+               && tw.weights == tv.weights);
+        // plain arrays decode too, and packed data survives splitting
+        assert(msgpack::decode(msgpack::unparse(Json::array(Json::array(3, 4),
+                                                             Json::array(1, 2.5))), tw)
+               && tw.lognos[1] == 4 && tw.weights[1] == 2.5);
+        msgpack::streaming_parser sp;
+        for (int i = 0; i != s.length(); ++i)
+            sp.consume(s.data() + i, 1);
+        assert(sp.success() && sp.result().unparse() == "[[1,-2,1099511627776],[0.5]]");
+        const char fixext[] = "\xD7\x02\0\0\0\0\0\0\xF0\x3F";
+        assert(msgpack::parse(fixext, fixext + 10).unparse() == "[1]");
+        const char other[] = "\xD7\x05\0\0\0\0\0\0\xF0\x3F";
+        sp.reset();
+        sp.consume(other, 10);
+        assert(sp.error());
+        // event handlers reject ext values unless they override ext()
+        test_event_log log;
+        msgpack::event_parser ep(log);
+        ep.consume(s.data(), s.length());
+        assert(ep.error());
+    }
+
+    {
+        // bin values stay bin; only str values are checked as UTF-8
+        test_blob b{"n\xC3\xA9", msgpack::binary(String("\xFF\x00\xFE", 3))};
+        String s = msgpack::unparse(b);
+        assert(s.length() == 10 && s[5] == char(msgpack::format::fbin8));
+        test_blob c;
+        assert(msgpack::decode(s, c) && c.data.data.length() == 3
+               && c.data.data.data() == s.data() + 7);
+        assert(!msgpack::decode(msgpack::unparse(Json::array("n", "xyz")), c));
+        msgpack::view v(s);
+        assert(v[0].is_str() && !v[0].is_bin() && v[1].is_bin() && v[1].is_s());
+        msgpack::streaming_parser sp;
+        sp.set_check_utf8(true);
+        sp.consume(s.begin(), s.end(), s);
+        assert(sp.success() && sp.result()[1].as_s().length() == 3);
+        String bad = msgpack::unparse(Json::array(String("\xFF\x00\xFE", 3)));
+        sp.reset();
+        sp.consume(bad.begin(), bad.end(), bad);
+        assert(sp.error());
+        sp.reset();
+        for (int i = 0; i != bad.length(); ++i)
+            sp.consume(bad.data() + i, 1);
+        assert(sp.error());
+        sp.reset();
+        sp.set_check_utf8(false);
+        sp.consume(bad.begin(), bad.end(), bad);
+        assert(sp.success());
+    }
+
+    {
+        // compressed frames round-trip; corrupt ones are refused
+        Json j = Json::array(-1, 7, Json::make_array());
+        for (int i = 0; i != 500; ++i)
+            j[2].push_back(Json::object("key", i % 7, "value", "replicated"));
+        String s = msgpack::unparse(j);
+        StringAccum z;
+        assert(mpcompress::compress(mpcompress::lz, s.data(), s.length(), z));
+        assert(z.length() < s.length() / 4);
+        StringAccum out;
+        assert(mpcompress::decompress(mpcompress::lz, z.data(), z.length(),
+                                      s.length(), out));
+        assert(String(out.data(), out.length()) == s);
+        assert(!mpcompress::decompress(mpcompress::lz, z.data(), z.length(),
+                                       s.length() + 1, out));
+        assert(!mpcompress::decompress(mpcompress::lz, z.data(),
+                                       z.length() / 2, s.length(), out));
+        assert(!mpcompress::decompress(mpcompress::lz, z.data(), z.length(),
+                                       (size_t(1) << 32) + 16, out));
+        assert(!mpcompress::decompress(mpcompress::lz, z.data(), 2,
+                                       s.length(), out));
+        assert(out.length() == s.length());
+        assert(!mpcompress::compress(mpcompress::lz, "abc", 3, z));
+    }
+
     std::cout << "All tests pass!\n";
 }
 
@@ -0,0 +1,306 @@
+#include "uring.hh"
+#include <algorithm>
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#if HAVE_LINUX_IO_URING_H && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+namespace {
+inline int sys_io_uring_setup(unsigned entries, struct io_uring_params* p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+inline int sys_io_uring_enter(int fd, unsigned to_submit,
+                              unsigned min_complete, unsigned flags) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                   nullptr, 0);
+}
+inline int sys_io_uring_register(int fd, unsigned opcode, const void* arg,
+                                 unsigned nr_args) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+}
+
+uring::~uring() {
+    clear();
+}
+
+bool uring::initialize(unsigned entries) {
+    assert(fd_ < 0);
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    fd_ = sys_io_uring_setup(entries, &p);
+    if (fd_ < 0)
+        return false;
+
+    sq_ring_size_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_ring_size_ = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+    sqes_size_ = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+    if (sq_ring_ == MAP_FAILED) {
+        sq_ring_ = nullptr;
+        clear();
+        return false;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        cq_ring_ = sq_ring_;
+    else {
+        cq_ring_ = mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+        if (cq_ring_ == MAP_FAILED) {
+            cq_ring_ = nullptr;
+            clear();
+            return false;
+        }
+    }
+    void* sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        clear();
+        return false;
+    }
+    sqes_ = reinterpret_cast<struct io_uring_sqe*>(sqes);
+
+    char* sq = reinterpret_cast<char*>(sq_ring_);
+    sq_head_ = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+    sq_tail_ = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+    sq_mask_ = *reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+    sq_entries_ = *reinterpret_cast<unsigned*>(sq + p.sq_off.ring_entries);
+    sq_array_ = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+    sqe_head_ = sqe_tail_ = *sq_tail_;
+
+    char* cq = reinterpret_cast<char*>(cq_ring_);
+    cq_head_ = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<struct io_uring_cqe*>(cq + p.cq_off.cqes);
+
+    register_fixed_buffers();
+    return true;
+}
+
+void uring::clear() {
+    if (sqes_)
+        munmap(sqes_, sqes_size_);
+    if (cq_ring_ && cq_ring_ != sq_ring_)
+        munmap(cq_ring_, cq_ring_size_);
+    if (sq_ring_)
+        munmap(sq_ring_, sq_ring_size_);
+    if (fd_ >= 0)
+        close(fd_);
+    delete[] fixed_free_;
+    fd_ = -1;
+    sqes_ = nullptr;
+    sq_ring_ = cq_ring_ = nullptr;
+    nfixed_ = fixed_nfree_ = 0;
+    fixed_free_ = nullptr;
+    fixed_failed_ = false;
+}
+
+struct io_uring_sqe* uring::get_sqe() {
+    unsigned head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+    if (sqe_tail_ - head >= sq_entries_) {
+        // ring full: hand what we have to the kernel and retry
+        if (submit() <= 0)
+            return nullptr;
+        head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+        if (sqe_tail_ - head >= sq_entries_)
+            return nullptr;
+    }
+    struct io_uring_sqe* sqe = &sqes_[sqe_tail_ & sq_mask_];
+    ++sqe_tail_;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+bool uring::next_completion(uint64_t& data, int& res, unsigned& flags) {
+    unsigned head = *cq_head_;
+    if (head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE))
+        return false;
+    const struct io_uring_cqe* cqe = &cqes_[head & cq_mask_];
+    data = cqe->user_data;
+    res = cqe->res;
+    flags = cqe->flags;
+    __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/** @brief Prepare a read of up to @a len bytes from @a fd into @a buf.
+
+    If @a slot is a registered buffer slot containing @a buf, the read
+    uses the fixed buffer. */
+bool uring::prepare_read(int fd, void* buf, size_t len, uint64_t data,
+                         int slot) {
+    struct io_uring_sqe* sqe = get_sqe();
+    if (!sqe)
+        return false;
+    if (slot >= 0) {
+        sqe->opcode = IORING_OP_READ_FIXED;
+        sqe->buf_index = slot;
+    } else
+        sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uintptr_t>(buf);
+    sqe->len = len;
+    sqe->off = (uint64_t) -1;   // use and advance the file position
+    sqe->user_data = data;
+    return true;
+}
+
+bool uring::prepare_writev(int fd, const struct iovec* iov, int iovcnt,
+                           uint64_t data) {
+    struct io_uring_sqe* sqe = get_sqe();
+    if (!sqe)
+        return false;
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uintptr_t>(iov);
+    sqe->len = iovcnt;
+    sqe->off = (uint64_t) -1;
+    sqe->user_data = data;
+    return true;
+}
+
+bool uring::prepare_cancel(uint64_t target, uint64_t data) {
+    struct io_uring_sqe* sqe = get_sqe();
+    if (!sqe)
+        return false;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = target;
+    sqe->user_data = data;
+    return true;
+}
+
+int uring::submit() {
+    unsigned n = sqe_tail_ - sqe_head_;
+    if (n == 0)
+        return 0;
+    unsigned tail = *sq_tail_;
+    for (; sqe_head_ != sqe_tail_; ++sqe_head_, ++tail)
+        sq_array_[tail & sq_mask_] = sqe_head_ & sq_mask_;
+    __atomic_store_n(sq_tail_, tail, __ATOMIC_RELEASE);
+    int r;
+    do {
+        r = sys_io_uring_enter(fd_, n, 0, 0);
+    } while (r < 0 && errno == EINTR);
+    return r < 0 ? -errno : r;
+}
+
+void uring::register_fixed_buffers() {
+    struct io_uring_rsrc_register rr;
+    memset(&rr, 0, sizeof(rr));
+    rr.nr = nfixed_buffers;
+    rr.flags = IORING_RSRC_REGISTER_SPARSE;
+    if (sys_io_uring_register(fd_, IORING_REGISTER_BUFFERS2,
+                              &rr, sizeof(rr)) < 0)
+        return;                 // older kernel: no fixed buffers
+    nfixed_ = fixed_nfree_ = nfixed_buffers;
+    fixed_free_ = new int[nfixed_];
+    for (int i = 0; i != nfixed_; ++i)
+        fixed_free_[i] = nfixed_ - 1 - i;
+}
+
+/** @brief Register a fixed buffer.
+
+    Returns the buffer's slot, or -1 if no slot is available or the
+    kernel refuses the buffer, for instance over RLIMIT_MEMLOCK. Reads
+    into a registered buffer avoid pinning its pages on every
+    operation. */
+int uring::register_buffer(const void* buf, size_t len) {
+    if (fixed_nfree_ == 0 || fixed_failed_)
+        return -1;
+    int slot = fixed_free_[--fixed_nfree_];
+    if (!update_buffer(slot, buf, len)) {
+        fixed_free_[fixed_nfree_++] = slot;
+        return -1;
+    }
+    return slot;
+}
+
+/** @brief Point @a slot at a new buffer.
+
+    Returns false if the kernel refuses; the slot is then unusable, and
+    has_fixed_buffers() turns false so callers stop paying for attempts
+    that will keep failing. */
+bool uring::update_buffer(int slot, const void* buf, size_t len) {
+    assert(slot >= 0 && slot < nfixed_);
+    struct iovec iov;
+    iov.iov_base = const_cast<void*>(buf);
+    iov.iov_len = len;
+    struct io_uring_rsrc_update2 up;
+    memset(&up, 0, sizeof(up));
+    up.offset = slot;
+    up.data = reinterpret_cast<uintptr_t>(&iov);
+    up.nr = 1;
+    if (sys_io_uring_register(fd_, IORING_REGISTER_BUFFERS_UPDATE,
+                              &up, sizeof(up)) == 1)
+        return true;
+    if (buf)
+        fixed_failed_ = true;
+    return false;
+}
+
+void uring::unregister_buffer(int slot) {
+    update_buffer(slot, nullptr, 0);
+    fixed_free_[fixed_nfree_++] = slot;
+}
+
+#else
+
+uring::~uring() {
+}
+
+bool uring::initialize(unsigned) {
+    return false;
+}
+
+void uring::clear() {
+}
+
+bool uring::next_completion(uint64_t&, int&, unsigned&) {
+    return false;
+}
+
+struct io_uring_sqe* uring::get_sqe() {
+    return nullptr;
+}
+
+bool uring::prepare_read(int, void*, size_t, uint64_t, int) {
+    return false;
+}
+
+bool uring::prepare_writev(int, const struct iovec*, int, uint64_t) {
+    return false;
+}
+
+bool uring::prepare_cancel(uint64_t, uint64_t) {
+    return false;
+}
+
+int uring::submit() {
+    return -ENOSYS;
+}
+
+int uring::register_buffer(const void*, size_t) {
+    return -1;
+}
+
+bool uring::update_buffer(int, const void*, size_t) {
+    return false;
+}
+
+void uring::unregister_buffer(int) {
+}
+
+void uring::register_fixed_buffers() {
+}
+
+#endif
@@ -0,0 +1,127 @@
+// -*- mode: c++ -*-
+#ifndef MPRPC_URING_HH
+#define MPRPC_URING_HH
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+// uring: a minimal io_uring submission/completion ring, using the raw
+// system calls so liburing is not required.
+//
+// Submission queue entries are staged with prepare_*() and handed to
+// the kernel together by submit(), so one io_uring_enter covers every
+// operation prepared since the last call. The ring's file descriptor
+// becomes readable when completions are available; reap() consumes
+// them.
+
+class uring {
+  public:
+    inline uring();
+    ~uring();
+
+    bool initialize(unsigned entries);
+    void clear();
+
+    inline bool valid() const;
+    inline int fd() const;
+    inline unsigned pending() const;
+
+    bool prepare_read(int fd, void* buf, size_t len, uint64_t data,
+                      int slot = -1);
+    bool prepare_writev(int fd, const struct iovec* iov, int iovcnt,
+                        uint64_t data);
+    bool prepare_cancel(uint64_t target, uint64_t data);
+    int submit();
+
+    template <typename F> unsigned reap(F f);
+
+    // Registered ("fixed") buffers live in a sparse table; a slot may be
+    // pointed at a new buffer whenever its owner reallocates. After a
+    // registration fails, has_fixed_buffers() is false.
+    inline bool has_fixed_buffers() const;
+    int register_buffer(const void* buf, size_t len);
+    bool update_buffer(int slot, const void* buf, size_t len);
+    void unregister_buffer(int slot);
+
+  private:
+    int fd_;
+    unsigned* sq_head_;
+    unsigned* sq_tail_;
+    unsigned sq_mask_;
+    unsigned sq_entries_;
+    unsigned* sq_array_;
+    struct io_uring_sqe* sqes_;
+    unsigned sqe_head_;
+    unsigned sqe_tail_;
+    unsigned* cq_head_;
+    unsigned* cq_tail_;
+    unsigned cq_mask_;
+    struct io_uring_cqe* cqes_;
+    void* sq_ring_;
+    size_t sq_ring_size_;
+    void* cq_ring_;
+    size_t cq_ring_size_;
+    size_t sqes_size_;
+
+    int nfixed_;
+    int* fixed_free_;
+    int fixed_nfree_;
+    bool fixed_failed_;
+
+    enum { nfixed_buffers = 4096 };
+
+    struct io_uring_sqe* get_sqe();
+    bool next_completion(uint64_t& data, int& res, unsigned& flags);
+    void register_fixed_buffers();
+
+    uring(const uring&) = delete;
+    uring& operator=(const uring&) = delete;
+};
+
+inline uring::uring()
+    : fd_(-1), sq_head_(nullptr), sq_tail_(nullptr), sq_array_(nullptr),
+      sqes_(nullptr), sqe_head_(0), sqe_tail_(0),
+      cq_head_(nullptr), cq_tail_(nullptr), cqes_(nullptr),
+      sq_ring_(nullptr), sq_ring_size_(0), cq_ring_(nullptr), cq_ring_size_(0),
+      sqes_size_(0), nfixed_(0), fixed_free_(nullptr), fixed_nfree_(0),
+      fixed_failed_(false) {
+}
+
+inline bool uring::valid() const {
+    return fd_ >= 0;
+}
+
+inline int uring::fd() const {
+    return fd_;
+}
+
+inline unsigned uring::pending() const {
+    return sqe_tail_ - sqe_head_;
+}
+
+inline bool uring::has_fixed_buffers() const {
+    return nfixed_ != 0 && !fixed_failed_;
+}
+
+/** @brief Consume available completions.
+
+    Calls @a f(data, res, flags) for each completion, where @a data is
+    the value passed to prepare_*() and @a res is the operation's result
+    (a byte count or a negative errno). Returns the number of completions
+    consumed. */
+template <typename F>
+unsigned uring::reap(F f) {
+    unsigned n = 0;
+    uint64_t data;
+    int res;
+    unsigned flags;
+    while (next_completion(data, res, flags)) {
+        f(data, res, flags);
+        ++n;
+    }
+    return n;
+}
+
+#endif
@@ -1,10 +1,12 @@
 // -*- mode: c++ -*-
 #include "vrnetchannel.hh"
 #include "mpfd.hh"
+#include "mpshm.hh"
 
 class Vrnetchannel : public Vrchannel {
   public:
-    Vrnetchannel(String local_uid, String remote_uid, tamer::fd cfd);
+    Vrnetchannel(String local_uid, String remote_uid, tamer::fd cfd,
+                 int codec);
     ~Vrnetchannel();
 
     void send(Json msg, tamer::event<> done);
@@ -16,20 +18,66 @@ class Vrnetchannel : public Vrchannel {
     msgpack_fd cfd_;
 };
 
+class Vrshmchannel : public Vrchannel {
+  public:
+    Vrshmchannel(String local_uid, String remote_uid);
+    ~Vrshmchannel();
+
+    inline msgpack_shm& shm() {
+        return shm_;
+    }
+
+    void send(Json msg, tamer::event<> done);
+    void receive(tamer::event<Json> done);
+    void close();
+    Json status() const;
+
+  private:
+    msgpack_shm shm_;
+};
+
 
 Vrnetlistener::Vrnetlistener(String local_uid, Json peer_name,
                              std::mt19937& rg)
-    : Vrchannel(std::move(local_uid), String()), rg_(rg) {
-    if (peer_name && peer_name["port"].is_nonnegint())
+    : Vrchannel(std::move(local_uid), String()), shm_(false),
+      codec_(compression(peer_name)), rg_(rg) {
+    if (peer_name && peer_name["port"].is_nonnegint()) {
         fd_ = tamer::tcp_listen(peer_name["port"].to_i());
-    else if (peer_name && peer_name["path"].is_s())
-        complete_unix_listen(peer_name["path"].to_s());
+        start_accepting(peer_name);
+    } else if (peer_name && peer_name["path"].is_s())
+        complete_unix_listen(peer_name["path"].to_s(), peer_name);
+    else if (peer_name && peer_name["shm"].is_s()) {
+        // shared-memory rings, set up over a Unix socket
+        shm_ = true;
+        complete_unix_listen(peer_name["shm"].to_s(), peer_name);
+    }
+}
+
+/** Accept connections on fd_. After a failover every client reconnects
+    at once; an "accept_rate" member of @a peer_name caps how many
+    connections per second are taken on. */
+void Vrnetlistener::start_accepting(const Json& peer_name) {
+    if (peer_name["accept_rate"].is_number())
+        acceptor_.set_rate_limit(peer_name["accept_rate"].as_d());
+    acceptor_.initialize(fd_);
 }
 
 Vrnetlistener::~Vrnetlistener() {
 }
 
-tamed void Vrnetlistener::complete_unix_listen(String path) {
+/** Return the codec for messages to the replica at @a peer_name. A
+    "compress" member names a codec, or is true for the built-in one. */
+int Vrnetlistener::compression(const Json& peer_name) {
+    Json c = peer_name ? peer_name["compress"] : Json();
+    if (c.is_s())
+        return mpcompress::find(c.as_s());
+    else if (c.is_bool() && c.as_b())
+        return mpcompress::lz;
+    else
+        return mpcompress::none;
+}
+
+tamed void Vrnetlistener::complete_unix_listen(String path, Json peer_name) {
     tvars { struct stat st; tamer::fd checkfd; }
     // Remove an old socket that's no longer connected.
     if (stat(path.c_str(), &st) == 0
@@ -39,11 +87,16 @@ tamed void Vrnetlistener::complete_unix_listen(String path) {
             unlink(path.c_str());
     }
     fd_ = tamer::unix_stream_listen(path);
+    start_accepting(peer_name);
 }
 
 tamed void Vrnetlistener::connect(String peer_uid, Json peer_name,
                                   tamer::event<std::shared_ptr<Vrchannel> > done) {
-    tamed { struct in_addr a; tamer::fd cfd; }
+    tamed {
+        struct in_addr a;
+        tamer::fd cfd;
+        std::shared_ptr<Vrshmchannel> shmc;
+    }
 
     if ((peer_name["ip"].is_null() || peer_name["ip"].is_s())
         && peer_name["port"].is_nonnegint()) {
@@ -58,29 +111,47 @@ tamed void Vrnetlistener::connect(String peer_uid, Json peer_name,
     } else if (peer_name["path"].is_s())
         twait { tamer::unix_stream_connect(peer_name["path"].to_s(),
                                            tamer::make_event(cfd)); }
+    else if (peer_name["shm"].is_s()) {
+        twait { tamer::unix_stream_connect(peer_name["shm"].to_s(),
+                                           tamer::make_event(cfd)); }
+        if (cfd) {
+            shmc = std::make_shared<Vrshmchannel>(local_uid(), peer_uid);
+            if (!shmc->shm().create(std::move(cfd)))
+                shmc.reset();
+        }
+    }
 
-    if (cfd)
-        done(std::make_shared<Vrnetchannel>(local_uid(), peer_uid, std::move(cfd)));
+    if (shmc)
+        done(shmc);
+    else if (cfd)
+        done(std::make_shared<Vrnetchannel>(local_uid(), peer_uid,
+                                            std::move(cfd),
+                                            compression(peer_name)));
     else
         done(nullptr);
 }
 
-typedef union {
-    struct sockaddr s;
-    struct sockaddr_in sin;
-} my_sockaddr_union;
-
 tamed void Vrnetlistener::receive_connection(tamer::event<std::shared_ptr<Vrchannel> > done) {
     tamed {
-        my_sockaddr_union sa;
-        socklen_t salen = sizeof(sa);
         tamer::fd cfd;
+        std::shared_ptr<Vrshmchannel> shmc;
+        bool ok;
     }
 
-    twait { fd_.accept(&sa.s, &salen, tamer::make_event(cfd)); }
+    twait { acceptor_.accept(tamer::make_event(cfd)); }
 
-    if (cfd)
-        done(std::make_shared<Vrnetchannel>(local_uid(), String(), std::move(cfd)));
+    if (cfd && shm_) {
+        shmc = std::make_shared<Vrshmchannel>(local_uid(), String());
+        twait { shmc->shm().accept(cfd, tamer::make_event(ok)); }
+        if (ok)
+            done(shmc);
+        else {
+            log_connection(this) << "error in receiving shared memory\n";
+            done(nullptr);
+        }
+    } else if (cfd)
+        done(std::make_shared<Vrnetchannel>(local_uid(), String(),
+                                            std::move(cfd), codec_));
     else {
         log_connection(this) << "error in receiving connection: "
                              << strerror(-cfd.error())
@@ -93,10 +164,18 @@ void Vrnetlistener::close() {
     fd_.close();
 }
 
+Json Vrnetlistener::status() const {
+    return acceptor_.status();
+}
+
 
-Vrnetchannel::Vrnetchannel(String local_uid, String remote_uid, tamer::fd cfd)
+Vrnetchannel::Vrnetchannel(String local_uid, String remote_uid, tamer::fd cfd,
+                           int codec)
     : Vrchannel(std::move(local_uid), std::move(remote_uid)),
       cfd_(std::move(cfd)) {
+    // replication batches compress well
+    if (codec)
+        cfd_.set_compression(codec, 4096);
 }
 
 Vrnetchannel::~Vrnetchannel() {
@@ -117,3 +196,27 @@ void Vrnetchannel::close() {
 Json Vrnetchannel::status() const {
     return cfd_.status();
 }
+
+
+Vrshmchannel::Vrshmchannel(String local_uid, String remote_uid)
+    : Vrchannel(std::move(local_uid), std::move(remote_uid)) {
+}
+
+Vrshmchannel::~Vrshmchannel() {
+}
+
+void Vrshmchannel::send(Json msg, tamer::event<> done) {
+    shm_.write(std::move(msg), std::move(done));
+}
+
+void Vrshmchannel::receive(tamer::event<Json> done) {
+    shm_.read(std::move(done));
+}
+
+void Vrshmchannel::close() {
+    shm_.clear();
+}
+
+Json Vrshmchannel::status() const {
+    return shm_.status();
+}